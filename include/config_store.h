@@ -0,0 +1,134 @@
+/*
+
+The binary config record for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+The config is saved as one record: a header and then the config struct as it is in
+memory. The header has the version of the struct, its size, a sequence number and a
+CRC32 of all of that so a record that was only partly written (power lost during a
+save) or that is from some other firmware is never used. The CRC is the commit marker.
+
+There are two slots (A and B) and each save goes in the other one from the last, with
+the next sequence number. The newest valid slot is the config, so if the power goes
+while one slot is being written the other still has the previous save.
+
+Fields are only ever added to the end of the config struct. configUnpack() starts from
+the defaults and copies over as much as the record has, so a record saved by an older
+version gets the defaults for anything added since. The version tells the caller if
+anything else needs fixing up.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define CONFIG_MAGIC 0x4B4D4D45 // "EMMK"
+
+#define CONFIG_SLOTS 2
+
+struct ConfigHeader
+{
+  uint32_t magic;
+  uint32_t crc;      // CRC32 of the rest of the record, from sequence on
+  uint32_t sequence; // goes up by one each save
+  uint16_t version;
+  uint16_t size;     // of the config struct that follows
+};
+
+#define CONFIG_CRC_START 8 // the offset of sequence in ConfigHeader
+
+// The usual CRC32 (as zlib), a bit at a time as the config is only a few hundred bytes
+inline uint32_t configCrc(const uint8_t *data, size_t length)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  for(size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+
+    for(int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+
+  return ~crc;
+}
+
+// The slot a save with this sequence number goes in
+inline int configSlot(uint32_t sequence)
+{
+  return sequence % CONFIG_SLOTS;
+}
+
+// True if sequence a is after b, allowing for it wrapping around
+inline bool configNewer(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) > 0;
+}
+
+// Makes the record in record[] which must have room for sizeof(ConfigHeader) + size. Returns its length.
+inline size_t configPack(uint8_t *record, const void *config, uint16_t size, uint16_t version, uint32_t sequence)
+{
+  ConfigHeader header;
+
+  header.magic = CONFIG_MAGIC;
+  header.crc = 0;
+  header.sequence = sequence;
+  header.version = version;
+  header.size = size;
+
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), config, size);
+
+  header.crc = configCrc(record + CONFIG_CRC_START, sizeof(header) - CONFIG_CRC_START + size);
+  memcpy(record, &header, sizeof(header));
+
+  return sizeof(header) + size;
+}
+
+// Checks the record and gives its header, false if it isn't valid
+inline bool configCheck(const uint8_t *record, size_t length, ConfigHeader &header)
+{
+  if(length < sizeof(header))
+    return false;
+
+  memcpy(&header, record, sizeof(header));
+
+  if(header.magic != CONFIG_MAGIC || length < sizeof(header) + header.size)
+    return false;
+
+  return configCrc(record + CONFIG_CRC_START, sizeof(header) - CONFIG_CRC_START + header.size) == header.crc;
+}
+
+// config must already have the defaults in it. Returns false (and leaves config alone) if the record
+// isn't valid, otherwise version and sequence are set to what it was saved with.
+inline bool configUnpack(const uint8_t *record, size_t length, void *config, uint16_t size, uint16_t &version,
+  uint32_t &sequence)
+{
+  ConfigHeader header;
+
+  if(!configCheck(record, length, header))
+    return false;
+
+  memcpy(config, record + sizeof(header), header.size < size ? header.size : size);
+  version = header.version;
+  sequence = header.sequence;
+
+  return true;
+}
@@ -0,0 +1,143 @@
+/*
+
+Controller curves for the tilt controllers of the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+A curve takes a tilt angle and gives a controller value from -1 to 1. Angles are binary
+angles (65536 is a full turn) and the output is Q15 (32767 is 1.0). All the floating
+point work (exp() etc.) is done once by curveBuild() when the config changes, which fills
+a table of the curve from 0 to 1. The curves are symmetric about the centre so the table
+only needs that half. After that each update is one interpolated table read.
+
+The curves:
+
+  Linear  - output follows the angle
+  Expo    - the "expo" from model aviation, reduced response around the centre:
+            y = x * exp(a * (|x| - 1)) with a = amount / 100 * 5
+  S-Curve - reduced response around the centre and at the ends:
+            a blend of x and a raised cosine by amount / 100
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+#define CURVE_TABLE_BITS 8
+#define CURVE_TABLE_SIZE (1 << CURVE_TABLE_BITS)
+
+enum CurveType
+{
+  CURVE_LINEAR = 0,
+  CURVE_EXPO,
+  CURVE_SCURVE,
+  CURVE_TYPES
+};
+
+// The settings for one axis as they are saved in the config
+struct AxisSettings
+{
+  uint8_t curve;    // CurveType
+  uint8_t amount;   // 0 - 100% for expo and S-curve
+  uint8_t range;    // degrees of tilt for full output
+  uint8_t deadZone; // degrees around the centre with no output
+  bool invert;
+};
+
+struct ControllerCurve
+{
+  int16_t table[CURVE_TABLE_SIZE + 1]; // Q15 output for 0 to 1
+  int32_t deadZone;                    // binary angle
+  int32_t gain;                        // binary angle past the dead zone to Q15, in Q16
+  bool invert;
+};
+
+inline int32_t degreesToBinaryAngle(double degrees)
+{
+  return (int32_t)(degrees * 65536.0 / 360.0);
+}
+
+inline void curveBuild(ControllerCurve &curve, const AxisSettings &settings)
+{
+  double amount = settings.amount / 100.0;
+
+  for(int i = 0; i <= CURVE_TABLE_SIZE; i++)
+  {
+    double x = (double)i / CURVE_TABLE_SIZE;
+    double y;
+
+    switch(settings.curve)
+    {
+      case CURVE_EXPO:
+      {
+        double a = amount * 5.0;
+        y = x * exp(a * (x - 1.0));
+        break;
+      }
+
+      case CURVE_SCURVE:
+        y = (1.0 - amount) * x + amount * (1.0 - cos(M_PI * x)) / 2.0;
+        break;
+
+      default:
+        y = x;
+        break;
+    }
+
+    int32_t v = (int32_t)(y * 32767.0 + 0.5);
+
+    curve.table[i] = v > 32767 ? 32767 : (v < 0 ? 0 : v);
+  }
+
+  int32_t range = degreesToBinaryAngle(settings.range);
+  curve.deadZone = degreesToBinaryAngle(settings.deadZone);
+
+  if(range <= curve.deadZone)
+    range = curve.deadZone + 1;
+
+  curve.gain = (int32_t)(((int64_t)32768 << 16) / (range - curve.deadZone));
+  curve.invert = settings.invert;
+}
+
+// angle is a binary angle relative to the centre position, the result is Q15 -1 to 1
+inline int16_t curveApply(const ControllerCurve &curve, int32_t angle)
+{
+  bool negative = angle < 0;
+  int32_t a = negative ? -angle : angle;
+
+  a -= curve.deadZone;
+
+  if(a <= 0)
+    return 0;
+
+  int32_t x = (int32_t)(((int64_t)a * curve.gain) >> 16); // 0 to 1 in Q15
+
+  if(x > 32767)
+    x = 32767;
+
+  const int shift = 15 - CURVE_TABLE_BITS;
+  int32_t i = x >> shift;
+  int32_t fraction = x & ((1 << shift) - 1);
+  int32_t y = curve.table[i] + (((curve.table[i + 1] - curve.table[i]) * fraction) >> shift);
+
+  if(negative != curve.invert)
+    y = -y;
+
+  return (int16_t)y;
+}
@@ -0,0 +1,195 @@
+/*
+
+The controller mapping matrix for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+A route takes a source (a tilt angle, the pressure on the held pins or an option pin)
+through its own curve (see controller_curves.h) to a destination (pitch bend, a CC, a
+14 bit CC or channel pressure). The routes are saved in the config as a short list and
+compiled by routesCompile() into a flat array of just the routes that do something,
+with their curve tables built. Each update is then one pass over that array.
+
+Every source is given to the curve as a binary angle relative to its centre. For the
+tilt sources that is the real angle. Pressure and the option pins have full scale at
+90 (degrees) so a route's range setting works the same way for them.
+
+The output of a route is 14 bits (0 - 16383). For pitch bend and the other bipolar
+routes the centre is 8192. With ROUTE_ABSOLUTE the output goes up from 0 whichever way
+the source moves, the way the modwheel works.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "controller_curves.h"
+
+enum RouteSource
+{
+  SOURCE_PITCH = 0,
+  SOURCE_ROLL,
+  SOURCE_YAW,
+  SOURCE_PRESSURE, // the highest pressure of the held master note pins
+  SOURCE_OPTION1,  // option pins held or not
+  SOURCE_OPTION2,
+  SOURCE_OPTION3,
+  SOURCE_OPTION4,
+  SOURCE_OPTION5,
+  ROUTE_SOURCES
+};
+
+enum RouteDestination
+{
+  DEST_NONE = 0,
+  DEST_PITCH_BEND,
+  DEST_CC,               // param is the CC number
+  DEST_CC14,             // param is the MSB CC number (0 - 31), the LSB goes on param + 32
+  DEST_CHANNEL_PRESSURE,
+  ROUTE_DESTINATIONS
+};
+
+#define ROUTE_GATED    0x01 // only while option1 is held, the centre is sent once when it is let go
+#define ROUTE_ABSOLUTE 0x02 // output goes up from 0 whichever way the source moves
+
+#define MAX_ROUTES 8
+
+#define ROUTE_FULL_SCALE 16384 // 90 degrees as a binary angle, full scale for the non-tilt sources
+
+// A route as it is saved in the config
+struct Route
+{
+  uint8_t source;      // RouteSource
+  uint8_t destination; // RouteDestination
+  uint8_t param;
+  uint8_t flags;
+  AxisSettings axis;
+};
+
+struct CompiledRoute
+{
+  uint8_t source;
+  uint8_t destination;
+  uint8_t param;
+  uint8_t flags;
+  ControllerCurve curve;
+  int32_t last;  // last output sent, -1 if nothing yet
+  uint8_t msb;   // last 14 bit CC halves sent, 0xFF if nothing yet
+  uint8_t lsb;
+  bool active;   // for gated routes, option1 has been held
+};
+
+inline bool routeValid(const Route &route)
+{
+  return route.source < ROUTE_SOURCES && route.destination < ROUTE_DESTINATIONS && route.param < 128 &&
+    route.axis.curve < CURVE_TYPES && route.axis.amount <= 100 && route.axis.range <= 90 &&
+    route.axis.range > route.axis.deadZone;
+}
+
+// Builds compiled[] from the routes that go somewhere and returns how many there are. Where more
+// than one route goes to the same destination the last one wins. With highResCc the routes to
+// CCs 0 - 31 become 14 bit.
+inline int routesCompile(const Route *routes, int count, CompiledRoute *compiled, bool highResCc)
+{
+  int n = 0;
+
+  for(int i = 0; i < count; i++)
+  {
+    const Route &route = routes[i];
+
+    if(route.destination == DEST_NONE || !routeValid(route))
+      continue;
+
+    uint8_t destination = route.destination;
+
+    if(destination == DEST_CC && highResCc && route.param < 32)
+      destination = DEST_CC14;
+
+    if(destination == DEST_CC14 && route.param >= 32)
+      destination = DEST_CC;
+
+    // drop an earlier route to the same place
+    for(int j = 0; j < n; j++)
+    {
+      bool sameCc = (compiled[j].destination == DEST_CC || compiled[j].destination == DEST_CC14) &&
+        (destination == DEST_CC || destination == DEST_CC14) && compiled[j].param == route.param;
+
+      if(sameCc || (compiled[j].destination == destination && destination != DEST_CC && destination != DEST_CC14))
+      {
+        for(int k = j; k < n - 1; k++)
+          compiled[k] = compiled[k + 1];
+
+        n--;
+        break;
+      }
+    }
+
+    CompiledRoute &c = compiled[n++];
+
+    c.source = route.source;
+    c.destination = destination;
+    c.param = route.param;
+    c.flags = route.flags;
+    curveBuild(c.curve, route.axis);
+    c.last = -1;
+    c.msb = 0xFF;
+    c.lsb = 0xFF;
+    c.active = false;
+  }
+
+  return n;
+}
+
+inline bool routesUse(const CompiledRoute *compiled, int count, uint8_t source)
+{
+  for(int i = 0; i < count; i++)
+  {
+    if(compiled[i].source == source)
+      return true;
+  }
+
+  return false;
+}
+
+// What the route sends when nothing is happening
+inline int32_t routeRest(const CompiledRoute &route)
+{
+  return route.flags & ROUTE_ABSOLUTE ? 0 : 8192;
+}
+
+// The 14 bit output of the route for a source value
+inline int32_t routeValue(const CompiledRoute &route, int32_t input)
+{
+  int32_t value = curveApply(route.curve, input);
+
+  if(route.flags & ROUTE_ABSOLUTE)
+  {
+    if(value < 0)
+      value = -value;
+
+    value = (value * 16384) >> 15;
+  }
+  else
+  {
+    value = 8192 + ((value * 8192) >> 15);
+  }
+
+  if(value > 16383)
+    value = 16383;
+
+  return value;
+}
@@ -0,0 +1,170 @@
+/*
+
+Cross-talk compensation between neighbouring touch pads for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Touching one tine raises the readings of the tines next to it. Each pad only leaks
+into its physical neighbours so the coupling matrix is sparse: every pad has a
+coefficient for the pad on its left and one for the pad on its right. The estimated
+leakage is subtracted from each pad's delta (raw value minus benchmark) before it is
+compared with the thresholds.
+
+Everything is fixed point. The deltas are int16 and the coefficients are Q15 and the
+arrays are padded out to a multiple of 8 lanes (one 128 bit SIMD register of int16)
+with a zero delta on each end, so the kernel has no branches and no edge cases.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CROSSTALK_LANES 16 // enough for the 9 master note pins, a multiple of 8
+
+struct CrosstalkMatrix
+{
+  int16_t left[CROSSTALK_LANES];  // Q15 coupling from pad i - 1 into pad i
+  int16_t right[CROSSTALK_LANES]; // Q15 coupling from pad i + 1 into pad i
+};
+
+// delta[] has CROSSTALK_LANES + 2 entries with pad i at delta[i + 1]. delta[0] and
+// delta[CROSSTALK_LANES + 1] are always 0, as are the lanes past the last pad.
+inline void crosstalkCompensate(const CrosstalkMatrix &matrix, const int16_t *delta, int16_t *compensated)
+{
+  for(int i = 0; i < CROSSTALK_LANES; i++)
+  {
+    int32_t leak = (int32_t)matrix.left[i] * delta[i] + (int32_t)matrix.right[i] * delta[i + 2];
+    int32_t value = delta[i + 1] - (leak >> 15);
+
+    if(value > 32767)
+      value = 32767;
+    else if(value < -32768)
+      value = -32768;
+
+    compensated[i] = value;
+  }
+}
+
+inline bool crosstalkActive(const CrosstalkMatrix &matrix)
+{
+  for(int i = 0; i < CROSSTALK_LANES; i++)
+  {
+    if(matrix.left[i] || matrix.right[i])
+      return true;
+  }
+
+  return false;
+}
+
+// Calibration is a least squares fit of each pad's delta against the delta of a neighbour
+// while that neighbour is the one being touched: c = sum(d_i * d_j) / sum(d_j * d_j)
+struct CrosstalkCalibration
+{
+  int64_t sumCross[CROSSTALK_LANES][2]; // [pad][0 = from the left, 1 = from the right]
+  int64_t sumSquare[CROSSTALK_LANES][2];
+  uint32_t count[CROSSTALK_LANES][2];
+};
+
+inline void crosstalkCalibrationReset(CrosstalkCalibration &cal)
+{
+  for(int i = 0; i < CROSSTALK_LANES; i++)
+  {
+    for(int side = 0; side < 2; side++)
+    {
+      cal.sumCross[i][side] = 0;
+      cal.sumSquare[i][side] = 0;
+      cal.count[i][side] = 0;
+    }
+  }
+}
+
+// The pad a scan is for: the one with the largest delta, which must be over its on level.
+// Its neighbours may be over theirs as well, that is the crosstalk being measured, but if
+// any other pad is there are two fingers down and the scan is no use. Returns -1 then or
+// when nothing is touched. delta[] is laid out as for crosstalkCompensate().
+inline int crosstalkCalibrationPad(const int16_t *delta, const bool *on, int pads)
+{
+  int touched = -1;
+
+  for(int i = 0; i < pads; i++)
+  {
+    if(on[i] && (touched < 0 || delta[i + 1] > delta[touched + 1]))
+      touched = i;
+  }
+
+  for(int i = 0; i < pads && touched >= 0; i++)
+  {
+    if(on[i] && (i < touched - 1 || i > touched + 1))
+      return -1;
+  }
+
+  return touched;
+}
+
+// Add one scan where touchedPad is the pad being touched (see crosstalkCalibrationPad()).
+// delta[] is laid out as for crosstalkCompensate().
+inline void crosstalkCalibrationSample(CrosstalkCalibration &cal, const int16_t *delta, int touchedPad, int pads)
+{
+  int32_t dj = delta[touchedPad + 1];
+
+  if(touchedPad > 0) // the pad to the left sees this one as its right neighbour
+  {
+    cal.sumCross[touchedPad - 1][1] += (int64_t)delta[touchedPad] * dj;
+    cal.sumSquare[touchedPad - 1][1] += (int64_t)dj * dj;
+    cal.count[touchedPad - 1][1]++;
+  }
+
+  if(touchedPad < pads - 1) // and the pad to the right sees it as its left neighbour
+  {
+    cal.sumCross[touchedPad + 1][0] += (int64_t)delta[touchedPad + 2] * dj;
+    cal.sumSquare[touchedPad + 1][0] += (int64_t)dj * dj;
+    cal.count[touchedPad + 1][0]++;
+  }
+}
+
+// Work out the coefficients. Neighbours with fewer than minSamples scans are left uncoupled.
+// Returns the number of coefficients found.
+inline int crosstalkCalibrationSolve(const CrosstalkCalibration &cal, CrosstalkMatrix &matrix, uint32_t minSamples)
+{
+  const int32_t maxCoupling = 29491; // 0.9 in Q15, a neighbour never leaks more than this
+
+  int found = 0;
+
+  for(int i = 0; i < CROSSTALK_LANES; i++)
+  {
+    int16_t *coefficient[2] = {&matrix.left[i], &matrix.right[i]};
+
+    for(int side = 0; side < 2; side++)
+    {
+      *coefficient[side] = 0;
+
+      if(cal.count[i][side] >= minSamples && cal.sumSquare[i][side] > 0 && cal.sumCross[i][side] > 0)
+      {
+        int64_t c = (cal.sumCross[i][side] << 15) / cal.sumSquare[i][side];
+
+        if(c > maxCoupling)
+          c = maxCoupling;
+
+        *coefficient[side] = (int16_t)c;
+        found++;
+      }
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,181 @@
+/*
+
+Tap, shake and flick gestures from the MPU6050 for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+gestureUpdate() is called with every IMU reading: the linear acceleration (gravity
+taken out) in mg and the gyro in deg/s. It does a fixed amount of integer work per
+reading and returns an event when a gesture completes:
+
+  Tap   - a short sharp spike in acceleration, over within tapMaxMillis
+  Shake - the acceleration along one axis going past shakeThreshold one way then the
+          other shakeReversals times within shakeWindowMillis
+  Flick - a fast rotation about flickAxis that is over within flickMaxMillis, up or
+          down depending on the direction
+
+After any gesture nothing is detected for refractoryMillis so the bounce back from a
+flick or the end of a shake doesn't give a second event.
+
+There are no Arduino dependencies in here, the time is passed in, so the same code can
+be run on the host over recorded sensor streams.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+enum GestureEvent
+{
+  GESTURE_NONE = 0,
+  GESTURE_TAP,
+  GESTURE_SHAKE,
+  GESTURE_FLICK_UP,
+  GESTURE_FLICK_DOWN
+};
+
+#define GESTURES 4 // not counting GESTURE_NONE
+
+struct GestureSettings
+{
+  int16_t tapThreshold;   // mg
+  uint16_t tapMaxMillis;
+  int16_t shakeThreshold; // mg
+  uint8_t shakeReversals;
+  uint16_t shakeWindowMillis;
+  int16_t flickRate;      // deg/s
+  uint16_t flickMaxMillis;
+  uint8_t flickAxis;      // 0 - 2 for the gyro x, y or z axis
+  uint16_t refractoryMillis;
+};
+
+struct GestureDetector
+{
+  GestureSettings settings;
+  uint32_t quietUntil;
+
+  bool tapActive;
+  uint32_t tapStart;
+
+  uint8_t shakeAxis;
+  int8_t shakeSign;  // which way it last went past the threshold, 0 if not started
+  uint8_t shakeCount;
+  uint32_t shakeStart;
+
+  int8_t flickSign;  // 0 if no flick in progress
+  uint32_t flickStart;
+};
+
+inline void gestureReset(GestureDetector &detector, const GestureSettings &settings)
+{
+  detector.settings = settings;
+  detector.quietUntil = 0;
+  detector.tapActive = false;
+  detector.tapStart = 0;
+  detector.shakeAxis = 0;
+  detector.shakeSign = 0;
+  detector.shakeCount = 0;
+  detector.shakeStart = 0;
+  detector.flickSign = 0;
+  detector.flickStart = 0;
+}
+
+inline uint8_t gestureFound(GestureDetector &detector, uint8_t event, uint32_t now)
+{
+  detector.quietUntil = now + detector.settings.refractoryMillis;
+  detector.tapActive = false;
+  detector.shakeSign = 0;
+  detector.flickSign = 0;
+
+  return event;
+}
+
+// accel[] is the linear acceleration in mg and gyro[] is deg/s, now is in ms
+inline uint8_t gestureUpdate(GestureDetector &detector, const int16_t *accel, const int16_t *gyro, uint32_t now)
+{
+  const GestureSettings &s = detector.settings;
+
+  if((int32_t)(now - detector.quietUntil) < 0)
+    return GESTURE_NONE;
+
+  // flick
+  int16_t rate = gyro[s.flickAxis];
+
+  if(detector.flickSign == 0)
+  {
+    if(rate > s.flickRate || rate < -s.flickRate)
+    {
+      detector.flickSign = rate > 0 ? 1 : -1;
+      detector.flickStart = now;
+    }
+  }
+  else if(rate * detector.flickSign < s.flickRate / 2) // it has stopped
+  {
+    int8_t sign = detector.flickSign;
+    detector.flickSign = 0;
+
+    if(now - detector.flickStart <= s.flickMaxMillis)
+      return gestureFound(detector, sign > 0 ? GESTURE_FLICK_UP : GESTURE_FLICK_DOWN, now);
+  }
+
+  // tap, compared squared so there is no square root
+  int32_t squared = (int32_t)accel[0] * accel[0] + (int32_t)accel[1] * accel[1] + (int32_t)accel[2] * accel[2];
+  int32_t tapSquared = (int32_t)s.tapThreshold * s.tapThreshold;
+
+  if(!detector.tapActive)
+  {
+    if(squared > tapSquared)
+    {
+      detector.tapActive = true;
+      detector.tapStart = now;
+    }
+  }
+  else if(squared < tapSquared / 4) // back below half the threshold
+  {
+    detector.tapActive = false;
+
+    if(now - detector.tapStart <= s.tapMaxMillis)
+      return gestureFound(detector, GESTURE_TAP, now);
+  }
+
+  // shake
+  if(detector.shakeSign != 0 && now - detector.shakeStart > s.shakeWindowMillis)
+    detector.shakeSign = 0; // too slow, start again
+
+  if(detector.shakeSign == 0)
+  {
+    for(uint8_t axis = 0; axis < 3; axis++)
+    {
+      if(accel[axis] > s.shakeThreshold || accel[axis] < -s.shakeThreshold)
+      {
+        detector.shakeAxis = axis;
+        detector.shakeSign = accel[axis] > 0 ? 1 : -1;
+        detector.shakeCount = 0;
+        detector.shakeStart = now;
+        break;
+      }
+    }
+  }
+  else if(accel[detector.shakeAxis] * -detector.shakeSign > s.shakeThreshold) // past it the other way
+  {
+    detector.shakeSign = -detector.shakeSign;
+
+    if(++detector.shakeCount >= s.shakeReversals)
+      return gestureFound(detector, GESTURE_SHAKE, now);
+  }
+
+  return GESTURE_NONE;
+}
@@ -0,0 +1,144 @@
+/*
+
+Mahony sensor fusion for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+This is the alternative to the MPU6050's DMP: the raw gyro and accelerometer readings
+are fused into an orientation quaternion on the ESP32 (see "IMU Mode" in the config).
+It is the Mahony complementary filter without a magnetometer. The gyro is integrated
+and the error between the measured gravity and the gravity the quaternion predicts is
+fed back through a PI controller. kp sets how quickly the tilt follows the
+accelerometer and ki trims out gyro bias.
+
+The quaternion uses the same convention as the DMP so fusionQuaternionQ14() can go
+straight into tiltFromQuaternion() (see tilt.h).
+
+It is single precision float because the ESP32-S3 has a hardware FPU for that. There
+are no Arduino dependencies in here so the same code can be run on the host over
+recorded IMU readings.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+struct MahonyFilter
+{
+  float q0, q1, q2, q3; // w, x, y, z
+  float ix, iy, iz;     // integral of the error (rad/s)
+  float kp;
+  float ki;
+};
+
+inline void fusionReset(MahonyFilter &filter, float kp, float ki)
+{
+  filter.q0 = 1.0f;
+  filter.q1 = 0.0f;
+  filter.q2 = 0.0f;
+  filter.q3 = 0.0f;
+  filter.ix = 0.0f;
+  filter.iy = 0.0f;
+  filter.iz = 0.0f;
+  filter.kp = kp;
+  filter.ki = ki;
+}
+
+// Start at the tilt given by the accelerometer (yaw 0) so there is no settling time at boot
+inline void fusionStartFromAccel(MahonyFilter &filter, float ax, float ay, float az)
+{
+  float roll = atan2f(ay, az);
+  float pitch = atan2f(-ax, sqrtf(ay * ay + az * az));
+
+  float cr = cosf(roll / 2.0f);
+  float sr = sinf(roll / 2.0f);
+  float cp = cosf(pitch / 2.0f);
+  float sp = sinf(pitch / 2.0f);
+
+  filter.q0 = cr * cp;
+  filter.q1 = sr * cp;
+  filter.q2 = cr * sp;
+  filter.q3 = -sr * sp;
+}
+
+// gx, gy, gz in rad/s, the accelerometer in any units and dt in seconds
+inline void fusionUpdate(MahonyFilter &filter, float gx, float gy, float gz, float ax, float ay, float az, float dt)
+{
+  float q0 = filter.q0;
+  float q1 = filter.q1;
+  float q2 = filter.q2;
+  float q3 = filter.q3;
+
+  float norm = ax * ax + ay * ay + az * az;
+
+  if(norm > 0.0f) // no correction if the accelerometer has nothing (free fall)
+  {
+    norm = 1.0f / sqrtf(norm);
+    ax *= norm;
+    ay *= norm;
+    az *= norm;
+
+    // half of the gravity the quaternion predicts
+    float vx = q1 * q3 - q0 * q2;
+    float vy = q0 * q1 + q2 * q3;
+    float vz = q0 * q0 - 0.5f + q3 * q3;
+
+    // error is the cross product of measured and predicted gravity
+    float ex = ay * vz - az * vy;
+    float ey = az * vx - ax * vz;
+    float ez = ax * vy - ay * vx;
+
+    if(filter.ki > 0.0f)
+    {
+      filter.ix += 2.0f * filter.ki * ex * dt;
+      filter.iy += 2.0f * filter.ki * ey * dt;
+      filter.iz += 2.0f * filter.ki * ez * dt;
+      gx += filter.ix;
+      gy += filter.iy;
+      gz += filter.iz;
+    }
+
+    gx += 2.0f * filter.kp * ex;
+    gy += 2.0f * filter.kp * ey;
+    gz += 2.0f * filter.kp * ez;
+  }
+
+  // integrate the rate of change of the quaternion
+  gx *= 0.5f * dt;
+  gy *= 0.5f * dt;
+  gz *= 0.5f * dt;
+
+  filter.q0 = q0 - q1 * gx - q2 * gy - q3 * gz;
+  filter.q1 = q1 + q0 * gx + q2 * gz - q3 * gy;
+  filter.q2 = q2 + q0 * gy - q1 * gz + q3 * gx;
+  filter.q3 = q3 + q0 * gz + q1 * gy - q2 * gx;
+
+  norm = 1.0f / sqrtf(filter.q0 * filter.q0 + filter.q1 * filter.q1 + filter.q2 * filter.q2 + filter.q3 * filter.q3);
+  filter.q0 *= norm;
+  filter.q1 *= norm;
+  filter.q2 *= norm;
+  filter.q3 *= norm;
+}
+
+// The quaternion as the DMP gives it: [w, x, y, z] in Q14
+inline void fusionQuaternionQ14(const MahonyFilter &filter, int16_t *q)
+{
+  q[0] = (int16_t)lrintf(filter.q0 * 16384.0f);
+  q[1] = (int16_t)lrintf(filter.q1 * 16384.0f);
+  q[2] = (int16_t)lrintf(filter.q2 * 16384.0f);
+  q[3] = (int16_t)lrintf(filter.q3 * 16384.0f);
+}
@@ -0,0 +1,94 @@
+/*
+
+Latency histograms for the diagnostics screen of the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Adding a time to a histogram is a few shifts and an increment so it can be done in
+the note path. Times under 16us each have their own bucket, above that each power of
+two is split into 8 buckets so a percentile is correct to within 12.5% all the way up
+to 16 seconds. histogramPercentile() gives the bottom of the bucket.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_BUCKETS (16 + 20 * 8)
+
+struct LatencyHistogram
+{
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+  uint32_t count;
+};
+
+inline void histogramReset(LatencyHistogram &histogram)
+{
+  memset(&histogram, 0, sizeof(histogram));
+}
+
+inline int histogramBucket(uint32_t micros)
+{
+  if(micros < 16)
+    return micros;
+
+  int msb = 31 - __builtin_clz(micros);
+
+  if(msb > 23)
+    return HISTOGRAM_BUCKETS - 1;
+
+  return 16 + (msb - 4) * 8 + ((micros >> (msb - 3)) & 7);
+}
+
+// The smallest time that goes in the bucket
+inline uint32_t histogramBucketMicros(int bucket)
+{
+  if(bucket < 16)
+    return bucket;
+
+  int msb = (bucket - 16) / 8 + 4;
+
+  return (uint32_t)(8 + (bucket - 16) % 8) << (msb - 3);
+}
+
+inline void histogramAdd(LatencyHistogram &histogram, uint32_t micros)
+{
+  histogram.buckets[histogramBucket(micros)]++;
+  histogram.count++;
+}
+
+// percent is 1 - 100, returns 0 if there is nothing in the histogram
+inline uint32_t histogramPercentile(const LatencyHistogram &histogram, uint32_t percent)
+{
+  if(histogram.count == 0)
+    return 0;
+
+  uint32_t target = (histogram.count * percent + 99) / 100;
+  uint32_t total = 0;
+
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    total += histogram.buckets[i];
+
+    if(total >= target)
+      return histogramBucketMicros(i);
+  }
+
+  return histogramBucketMicros(HISTOGRAM_BUCKETS - 1);
+}
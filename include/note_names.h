@@ -0,0 +1,65 @@
+/*
+
+Note names for the display of the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+The names of all 128 MIDI notes are made once at boot with noteNamesBuild() and the
+notes display text is put together from them in a buffer the caller gives, so nothing
+in the note path uses the heap. Middle C (60) is C3.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define NOTE_NAME_SIZE 5 // "C#-2" and the terminator
+
+static const char *const keyNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+
+inline void noteNamesBuild(char names[128][NOTE_NAME_SIZE])
+{
+  for(int i = 0; i < 128; i++)
+    snprintf(names[i], NOTE_NAME_SIZE, "%s%d", keyNames[i % 12], i / 12 - 2);
+}
+
+// The names of the pins that are on, each followed by a space except for the last pin. offset is
+// added to each of notes[] (the key and octave). text[] is always terminated, what doesn't fit is
+// left off.
+inline void notesOnText(char *text, size_t size, const char names[128][NOTE_NAME_SIZE], const bool *on,
+  const uint8_t *notes, int pins, int offset)
+{
+  size_t length = 0;
+
+  text[0] = 0;
+
+  for(int i = 0; i < pins; i++)
+  {
+    if(on[i])
+    {
+      uint8_t note = notes[i] + offset;
+
+      length += snprintf(text + length, size - length, i < pins - 1 ? "%s " : "%s", names[note & 0x7F]);
+
+      if(length >= size)
+        break;
+    }
+  }
+}
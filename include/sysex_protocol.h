@@ -0,0 +1,178 @@
+/*
+
+The SysEx protocol of the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Every message is F0 7D 4B <command> <data> F7. 7D is the non-commercial manufacturer ID
+and 4B ('K') is the EMMMA-K. The data is 8 bit bytes packed into 7 bits: each group of
+up to 7 bytes is sent as a byte with their top bits (bit 0 for the first byte) and then
+the 7 bytes with their top bits cleared.
+
+  01 config request     reply is 02
+  02 config             the whole config record (see config_store.h), as a reply or to
+                        write the config, which is answered with 7E or 7F
+  03 stats request      reply is 04
+  04 stats              little-endian uint32s: loops per second, worst loop (us), send
+                        time 50th and 99th percentile (us), slave link errors, ESP-Now
+                        sent and failed, ESP-Now round trip 50th and 99th percentile
+                        (us), BLE connection interval (1.25ms), free heap and then the
+                        touch benchmark of each pin
+  7E ack
+  7F nak
+
+The parser is fed a byte at a time so a message can come in pieces of any size (USB or
+BLE SysEx chunks, ESP-Now packets) and it only needs the buffer for the decoded data.
+Real time messages in the middle of a message are ignored, any other status byte ends
+it.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define SYSEX_MANUFACTURER 0x7D
+#define SYSEX_DEVICE 0x4B
+
+enum SysexCommand
+{
+  SYSEX_NONE = 0,
+  SYSEX_CONFIG_REQUEST = 0x01,
+  SYSEX_CONFIG = 0x02,
+  SYSEX_STATS_REQUEST = 0x03,
+  SYSEX_STATS = 0x04,
+  SYSEX_ACK = 0x7E,
+  SYSEX_NAK = 0x7F
+};
+
+enum SysexState
+{
+  SYSEX_IDLE = 0,     // waiting for F0
+  SYSEX_ID,           // the manufacturer ID is next
+  SYSEX_TO_DEVICE,
+  SYSEX_COMMAND,
+  SYSEX_DATA,
+  SYSEX_OTHER         // not for us, waiting for the end
+};
+
+struct SysexParser
+{
+  uint8_t state;
+  uint8_t command;
+  uint8_t msbs;      // top bits of the group being decoded
+  uint8_t position;  // in the group, 0 is the top bits byte
+  uint16_t length;   // bytes decoded
+  bool overflow;     // there were more than capacity
+  uint8_t *buffer;
+  uint16_t capacity;
+};
+
+inline void sysexInit(SysexParser &parser, uint8_t *buffer, uint16_t capacity)
+{
+  parser.state = SYSEX_IDLE;
+  parser.buffer = buffer;
+  parser.capacity = capacity;
+}
+
+// Returns the command once a whole message for us has come, the data is then in the buffer
+// (parser.length bytes, check parser.overflow). Otherwise SYSEX_NONE.
+inline uint8_t sysexParse(SysexParser &parser, uint8_t byte)
+{
+  if(byte >= 0xF8) // real time
+    return SYSEX_NONE;
+
+  if(byte == 0xF0)
+  {
+    parser.state = SYSEX_ID;
+    return SYSEX_NONE;
+  }
+
+  if(byte & 0x80)
+  {
+    bool done = byte == 0xF7 && parser.state == SYSEX_DATA;
+
+    parser.state = SYSEX_IDLE;
+
+    return done ? parser.command : (uint8_t)SYSEX_NONE;
+  }
+
+  switch(parser.state)
+  {
+    case SYSEX_ID:
+      parser.state = byte == SYSEX_MANUFACTURER ? SYSEX_TO_DEVICE : SYSEX_OTHER;
+      break;
+
+    case SYSEX_TO_DEVICE:
+      parser.state = byte == SYSEX_DEVICE ? SYSEX_COMMAND : SYSEX_OTHER;
+      break;
+
+    case SYSEX_COMMAND:
+      parser.command = byte;
+      parser.position = 0;
+      parser.length = 0;
+      parser.overflow = false;
+      parser.state = byte ? SYSEX_DATA : SYSEX_OTHER;
+      break;
+
+    case SYSEX_DATA:
+      if(parser.position == 0)
+      {
+        parser.msbs = byte;
+      }
+      else
+      {
+        if(parser.length < parser.capacity)
+          parser.buffer[parser.length++] = byte | (((parser.msbs >> (parser.position - 1)) & 1) << 7);
+        else
+          parser.overflow = true;
+      }
+
+      parser.position = parser.position == 7 ? 0 : parser.position + 1;
+      break;
+  }
+
+  return SYSEX_NONE;
+}
+
+inline int sysexEncodedLength(int length)
+{
+  return length + (length + 6) / 7;
+}
+
+// out[] must have room for sysexEncodedLength(length). Returns the number of bytes put in it.
+// When a long message is encoded a piece at a time every piece but the last must be a multiple
+// of 7 bytes.
+inline int sysexEncode(const uint8_t *data, int length, uint8_t *out)
+{
+  int n = 0;
+
+  for(int i = 0; i < length; i += 7)
+  {
+    uint8_t &msbs = out[n++];
+
+    msbs = 0;
+
+    for(int j = 0; j < 7 && i + j < length; j++)
+    {
+      msbs |= (data[i + j] >> 7) << j;
+      out[n++] = data[i + j] & 0x7F;
+    }
+  }
+
+  return n;
+}
@@ -0,0 +1,133 @@
+/*
+
+Tilt angles straight from the MPU6050 DMP quaternion for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+This gives the same yaw/pitch/roll as the MPU6050 library's dmpGetGravity() and
+dmpGetYawPitchRoll() but works on the DMP's int16 quaternion (Q14, 16384 is 1.0)
+with integer maths only. The angles come out as binary angles: an int16 where 65536
+is a full turn, so the difference between two angles is always correct when it is
+done in int16 even if yaw has gone past 180 degrees.
+
+atan2() and the length of the gravity vector both come from CORDIC in vectoring mode
+(shifts and adds). The error is well under 0.01 degrees.
+
+Note that the names are the library's. The way the MPU6050 is mounted in the EMMMA-K
+the library's pitch is the roll of the instrument and the library's roll is its pitch.
+
+There are no Arduino dependencies in here so the same code can be run on the host.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+struct TiltAngles
+{
+  int16_t yaw;
+  int16_t pitch;
+  int16_t roll;
+};
+
+// atan(2^-i) as a fraction of a turn scaled by 2^24
+static const int32_t tiltCordicAngles[] = {
+  2097152, 1238021, 654136, 332050, 166669, 83416, 41718, 20860,
+  10430, 5215, 2608, 1304, 652, 326, 163, 81};
+
+#define TILT_CORDIC_STEPS (sizeof(tiltCordicAngles) / sizeof(tiltCordicAngles[0]))
+#define TILT_CORDIC_GAIN_INVERSE 39797 // 1 / 1.64676 in Q16
+
+// Returns atan2(y, x) as a binary angle. If magnitude isn't NULL it gets sqrt(x*x + y*y).
+// x and y must be less than 2^28 so there is room for the CORDIC gain.
+inline int16_t tiltAtan2(int32_t y, int32_t x, int32_t *magnitude = 0)
+{
+  int32_t angle = 0; // turns scaled by 2^24
+
+  if(x < 0) // rotate half a turn into the right half plane
+  {
+    x = -x;
+    y = -y;
+    angle = 1 << 23;
+  }
+
+  for(uint32_t i = 0; i < TILT_CORDIC_STEPS; i++)
+  {
+    int32_t dx = x >> i;
+    int32_t dy = y >> i;
+
+    if(y > 0)
+    {
+      x += dy;
+      y -= dx;
+      angle += tiltCordicAngles[i];
+    }
+    else
+    {
+      x -= dy;
+      y += dx;
+      angle -= tiltCordicAngles[i];
+    }
+  }
+
+  if(magnitude)
+    *magnitude = (int32_t)(((int64_t)x * TILT_CORDIC_GAIN_INVERSE) >> 16);
+
+  return (int16_t)(uint16_t)((angle + 128) >> 8);
+}
+
+// q is [w, x, y, z] in Q14 as given by MPU6050::dmpGetQuaternion(int16_t *, ...).
+// Yaw needs another atan2 so it is only worked out if withYaw is set.
+inline void tiltFromQuaternion(const int16_t *q, TiltAngles &angles, bool withYaw)
+{
+  int32_t w = q[0];
+  int32_t x = q[1];
+  int32_t y = q[2];
+  int32_t z = q[3];
+
+  // gravity in Q24 (the products are Q28, the factor of 2 is folded into the shift)
+  int32_t gx = (x * z - w * y) >> 3;
+  int32_t gy = (w * x + y * z) >> 3;
+  int32_t gz = (w * w - x * x - y * y + z * z) >> 4;
+
+  int32_t gyz;
+
+  angles.roll = tiltAtan2(gy, gz, &gyz); // gyz is the length of gravity in the y-z plane
+
+  int16_t pitch = tiltAtan2(gx, gyz); // -90 to 90 degrees
+
+  if(gz < 0) // upside down, as the library does
+    pitch = (int16_t)(pitch > 0 ? 32768 - pitch : -32768 - pitch);
+
+  angles.pitch = pitch;
+
+  if(withYaw)
+    angles.yaw = tiltAtan2((x * y - w * z) >> 3, (w * w + x * x - (1 << 27)) >> 3);
+}
+
+// Gravity in the sensor frame in mg, for taking it out of the accelerometer readings
+inline void tiltGravity(const int16_t *q, int16_t *gravity)
+{
+  int32_t w = q[0];
+  int32_t x = q[1];
+  int32_t y = q[2];
+  int32_t z = q[3];
+
+  // in Q16 first as above
+  gravity[0] = (((x * z - w * y) >> 11) * 1000) >> 16;
+  gravity[1] = (((w * x + y * z) >> 11) * 1000) >> 16;
+  gravity[2] = (((w * w - x * x - y * y + z * z) >> 12) * 1000) >> 16;
+}
@@ -0,0 +1,154 @@
+/*
+
+Per-pin touch threshold auto tuning for the EMMMA-K-v3.2 Master processor.
+
+Copyright 2023 RocketManRC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+The thresholds are worked out from two phases of raw readings for each pad:
+
+  idle  - nobody touching, gives the noise floor (mean and standard deviation)
+  touch - the pad being touched a few times, gives the typical touch delta (peak)
+
+The note on threshold is put as low as it can be (fastest detection) while keeping
+the chance of noise crossing it below the target false trigger rate. The note off
+threshold is kept far enough above the noise to always release and far enough below
+note on to not chatter.
+
+There are no Arduino dependencies in here so the same code can be run on the host
+over recorded touch traces.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+struct TouchPadStats
+{
+  uint32_t idleCount;
+  double idleSum;
+  double idleSumSq;
+  uint32_t touchPeak; // highest raw value seen in the touch phase
+};
+
+inline void autoTuneReset(TouchPadStats &stats)
+{
+  stats.idleCount = 0;
+  stats.idleSum = 0.0;
+  stats.idleSumSq = 0.0;
+  stats.touchPeak = 0;
+}
+
+inline void autoTuneIdleSample(TouchPadStats &stats, uint32_t raw)
+{
+  stats.idleCount++;
+  stats.idleSum += raw;
+  stats.idleSumSq += (double)raw * raw;
+}
+
+inline void autoTuneTouchSample(TouchPadStats &stats, uint32_t raw)
+{
+  if(raw > stats.touchPeak)
+    stats.touchPeak = raw;
+}
+
+// How many standard deviations above the mean gives a one sided Gaussian tail
+// probability of p. Found by bisection on erfc() which is good enough here.
+inline double autoTuneSigmas(double p)
+{
+  double lo = 0.0;
+  double hi = 10.0;
+
+  for(int i = 0; i < 40; i++)
+  {
+    double k = (lo + hi) / 2.0;
+
+    if(0.5 * erfc(k / sqrt(2.0)) > p)
+      lo = k;
+    else
+      hi = k;
+  }
+
+  return hi;
+}
+
+// Works out the note on and off thresholds in permille above benchmark (the existing
+// fixed values are 300 and 200). falseTriggerRate is the allowed probability of a
+// false note on per sample. Returns false if the pad is too noisy for its touch delta
+// to meet the target, in which case the thresholds are split around the middle of the
+// touch delta instead.
+inline bool autoTuneThresholds(const TouchPadStats &stats, uint32_t benchmark, double falseTriggerRate,
+  uint16_t &onPermille, uint16_t &offPermille)
+{
+  const double minOnFraction = 0.03;  // never closer than 3% to the benchmark
+  const double maxOnOfTouch = 0.6;    // note on must be reached well before a full touch
+
+  if(stats.idleCount < 2 || benchmark == 0)
+    return false;
+
+  double mean = stats.idleSum / stats.idleCount;
+  double variance = stats.idleSumSq / stats.idleCount - mean * mean;
+  double sigma = variance > 0.0 ? sqrt(variance) : 0.0;
+
+  if(sigma < 1.0)
+    sigma = 1.0; // raw values are integers so there is always at least this much
+
+  bool met = true;
+
+  double onDelta = autoTuneSigmas(falseTriggerRate) * sigma;
+
+  if(onDelta < minOnFraction * benchmark)
+    onDelta = minOnFraction * benchmark;
+
+  double touchDelta = stats.touchPeak > mean ? stats.touchPeak - mean : 0.0;
+
+  if(touchDelta > 0.0 && onDelta > maxOnOfTouch * touchDelta)
+  {
+    met = false;
+    onDelta = touchDelta / 2.0;
+  }
+
+  // keep the same 3:2 ratio as the fixed thresholds unless the noise says otherwise
+  double offDelta = onDelta * 2.0 / 3.0;
+
+  if(offDelta < 3.0 * sigma)
+    offDelta = 3.0 * sigma;  // always release
+
+  if(offDelta > onDelta - 2.0 * sigma)
+    offDelta = onDelta - 2.0 * sigma; // hysteresis so it doesn't chatter
+
+  if(offDelta < onDelta / 2.0)
+    offDelta = onDelta / 2.0;
+
+  // thresholds are applied relative to the benchmark so allow for any offset of the idle mean
+  double on = (mean - benchmark + onDelta) * 1000.0 / benchmark;
+  double off = (mean - benchmark + offDelta) * 1000.0 / benchmark;
+
+  if(on < 20.0)
+    on = 20.0;
+  else if(on > 600.0)
+    on = 600.0;
+
+  if(off < 10.0)
+    off = 10.0;
+  else if(off > on - 5.0)
+    off = on - 5.0;
+
+  onPermille = (uint16_t)(on + 0.5);
+  offPermille = (uint16_t)(off + 0.5);
+
+  return met;
+}
@@ -65,37 +65,328 @@ To support USB MIDI the following library is required
 #include <Adafruit_GFX.h>
 #include <Adafruit_SH110X.h>
 #include <ArduinoJson.h>  
+#include <Preferences.h>
+#include "touch_autotune.h"
+#include "crosstalk.h"
+#include "controller_curves.h"
+#include "tilt.h"
+#include "gestures.h"
+#include "controller_routes.h"
+#include "latency_histogram.h"
+#include "note_names.h"
+#include "config_store.h"
+#include "sysex_protocol.h"
 
 // forward references
-void handleChangeRequest(uint8_t type, uint8_t data1, uint8_t data2);
+bool handleChangeRequest(uint8_t type, uint8_t data1, uint8_t data2);
 void MPU6050Setup();
-void MPU6050Loop();
+bool MPU6050Loop();
+void printImuStats();
+void printDisplayStats();
+void displayFrameSent(uint32_t sendMicros, uint32_t bytes);
 void displayRefresh(); // Should displayMode() be used instead???
 void displayMode();
 
 // Configuration Default Values
 // To change the config update one or more of these values and rebuild.
-String configInit = "3.14159265359"; // if this is changed config will be initialized (default 3.14159265359)
 bool useBluetooth = false;
 int scaleIndex = 3; // default is minor pentatonic
 uint8_t midiChannel = 1;
 int masterVolume = 127; 
 bool adjacentPinsFilter = true;
 bool dissonantNotesFilter = true;
-uint8_t ccForModwheel = 1;
-String broadcastAddressMidiHub = "123456";
+bool highResCc = false; // send the tilt CCs 0 - 31 as 14 bit MSB/LSB pairs
+uint8_t broadcastAddressMidiHub[6] = {'1', '2', '3', '4', '5', '6'};
+uint8_t pressureMode = 0; // 0 is off, 1 is polyphonic aftertouch and 2 is channel pressure
+uint8_t touchProfile = 1; // balanced
+bool crosstalkCompensation = false;
+// The controller routes (see controller_routes.h). The first three are always from pitch, roll and yaw
+// and are the ones changed from the menu, any more come from the config file.
+#define ROUTE_PITCH 0
+#define ROUTE_ROLL 1
+#define ROUTE_YAW 2
+Route routes[MAX_ROUTES] = {
+  {SOURCE_PITCH, DEST_PITCH_BEND, 0, ROUTE_GATED, {CURVE_EXPO, 30, 30, 0, false}},          // 30% expo over 30 degrees
+  {SOURCE_ROLL, DEST_CC, 1, ROUTE_GATED | ROUTE_ABSOLUTE, {CURVE_LINEAR, 0, 25, 0, false}}, // modwheel over 25 degrees
+  {SOURCE_YAW, DEST_NONE, 0, ROUTE_GATED, {CURVE_LINEAR, 0, 45, 0, false}}                  // off, 45 degrees either way
+};
+uint8_t routeCount = 3;
+#define IMU_DMP 0
+#define IMU_FUSION 1
+uint8_t imuMode = IMU_DMP; // IMU_FUSION reads the raw gyro and accelerometer and fuses them here (see imu_fusion.h)
+int16_t imuOffsets[6]; // accel x, y, z then gyro x, y, z as written to the MPU6050 offset registers
+bool imuOffsetsSaved = false; // if not the full calibration is run at boot
+volatile bool imuCalibrateRequest = false; // set to have the IMU task recalibrate, cleared when it is done
+uint8_t gestureActions[GESTURES] = {0, 0, 0, 0}; // for tap, shake, flick up and flick down, see gestureActionNames[]
+uint8_t gestureParams[GESTURES] = {60, 80, 81, 82}; // the note for Note or the CC number for CC Toggle
 
 bool optionsMode = true; // if true UI changes options (scale, key, etc), else UI changes config
 bool wirelessChanged = false; // this will be set when the wireless mode changed causing a restart
+bool imuModeChanged = false; // as will this when the IMU mode is changed
 bool enableAdjacentPins = false;
 bool enableDissonantNotes = false;
 
-float ypr[3];  // [yaw, pitch, roll]   yaw/pitch/roll container and gravity vector
+TiltAngles tilt; // yaw/pitch/roll from the MPU6050 as binary angles (see tilt.h)
 
 #define SCREEN_WIDTH 64  // OLED display width, in pixels
 #define SCREEN_HEIGHT 128 // OLED display height, in pixels
 #define OLED_RESET -1     // can set an oled reset pin if desired
-Adafruit_SH1107 display = Adafruit_SH1107(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET, 1000000, 100000);
+
+// Pushing a full frame to the SH1107 is about 1KB over I2C which takes several ms. So that loop() never
+// waits for that, once startTask() has been called display() just copies the buffer into a spare frame,
+// swaps it in and wakes up the display task on the other core, which does the I2C. If loop() draws again
+// before the task gets to it only the latest frame is sent. From then on Wire is only used by the display
+// task.
+//
+// Almost everything clears the buffer and draws the whole screen again even when one note name has
+// changed so the task keeps a copy of what the display is showing and only sends what is different:
+// for each page (8 rows) the columns from the first to the last byte that changed. The callback is
+// called by the task after each frame with the time it took to send and the number of bytes sent.
+//
+// Text at size 1 can be drawn by printCached() from a cache of the font's glyphs built at boot by
+// buildGlyphCache(). Each glyph is kept as its 8 rows of 5 pixels which, with the display rotated, are
+// bytes across the pages of one column of the buffer, so a glyph goes in with a shift and at most 16
+// ORs instead of 40 drawPixel() calls. It lays the text out the same way as print() does.
+#define GLYPH_FIRST ' '
+#define GLYPH_LAST '~'
+
+typedef void (*DisplayCallback)(uint32_t sendMicros, uint32_t bytes);
+
+#define DISPLAY_STATS 0 // set to 1 to print the display frame send times and bytes every 10 seconds and the notes display benchmark at boot
+
+class EmmmaDisplay : public Adafruit_SH1107
+{
+public:
+  EmmmaDisplay(uint16_t w, uint16_t h, TwoWire *twi, int8_t rst_pin, uint32_t clkDuring, uint32_t clkAfter) :
+    Adafruit_SH1107(w, h, twi, rst_pin, clkDuring, clkAfter)
+  {
+  }
+
+  void display(void)
+  {
+    if(taskHandle == NULL)
+    {
+      Adafruit_SH1107::display(); // not started yet, send it right here
+      return;
+    }
+
+    memcpy(frameFree, buffer, frameBytes); // only the caller has this one
+
+    portENTER_CRITICAL(&frameMux);
+    uint8_t *ready = frameReady;
+    frameReady = frameFree;
+    frameFree = ready;
+    framePending = true;
+    portEXIT_CRITICAL(&frameMux);
+
+    xTaskNotifyGive(taskHandle);
+  }
+
+  void startTask(DisplayCallback callback)
+  {
+    frameSent = callback;
+    xTaskCreatePinnedToCore(task, "Display", 2048, this, 1, &taskHandle, 0);
+  }
+
+  void buildGlyphCache()
+  {
+    GFXcanvas1 canvas(8, 8);
+
+    for(int c = GLYPH_FIRST; c <= GLYPH_LAST; c++)
+    {
+      canvas.fillScreen(0);
+      canvas.drawChar(0, 0, c, 1, 0, 1);
+
+      for(int row = 0; row < 8; row++)
+      {
+        uint8_t bits = 0;
+
+        for(int column = 0; column < 5; column++)
+        {
+          if(canvas.getPixel(column, row))
+            bits |= 1 << column;
+        }
+
+        glyphs[c - GLYPH_FIRST][row] = bits;
+      }
+    }
+
+    glyphsBuilt = true;
+  }
+
+  void printCached(const char *text)
+  {
+    if(!glyphsBuilt || textsize_x != 1 || getRotation() != 1)
+    {
+      print(text);
+      return;
+    }
+
+    for(; *text; text++)
+    {
+      char c = *text;
+
+      if(c == '\n')
+      {
+        cursor_x = 0;
+        cursor_y += 8;
+        continue;
+      }
+
+      if(c == '\r')
+        continue;
+
+      if(wrap && cursor_x + 6 > _width)
+      {
+        cursor_x = 0;
+        cursor_y += 8;
+      }
+
+      if(c >= GLYPH_FIRST && c <= GLYPH_LAST)
+        blitGlyph(glyphs[c - GLYPH_FIRST], cursor_x, cursor_y);
+      else
+        drawChar(cursor_x, cursor_y, c, SH110X_WHITE, SH110X_WHITE, 1); // not cached
+
+      cursor_x += 6;
+    }
+  }
+
+private:
+  uint8_t glyphs[GLYPH_LAST - GLYPH_FIRST + 1][8];
+  bool glyphsBuilt = false;
+
+  // Rotation 1 puts the screen x along the buffer's rows and the screen y along its columns, backwards
+  void blitGlyph(const uint8_t *rows, int16_t x, int16_t y)
+  {
+    if(x < 0 || x >= _width)
+      return;
+
+    int page = x >> 3;
+    int shift = x & 7;
+
+    for(int row = 0; row < 8; row++)
+    {
+      int16_t screenY = y + row;
+
+      if(screenY < 0 || screenY >= _height || rows[row] == 0)
+        continue;
+
+      uint16_t bits = rows[row] << shift;
+      uint8_t *column = buffer + (SCREEN_WIDTH - 1 - screenY) + page * SCREEN_WIDTH;
+
+      column[0] |= bits & 0xFF;
+
+      if((bits >> 8) && page + 1 < SCREEN_HEIGHT / 8)
+        column[SCREEN_WIDTH] |= bits >> 8;
+    }
+  }
+
+  static const int pageBytes = SCREEN_WIDTH;
+  static const int pages = SCREEN_HEIGHT / 8;
+
+  static const int frameBytes = pages * pageBytes;
+
+  // Three frames so that only pointers are swapped with interrupts off. display() fills frameFree and
+  // swaps it with frameReady, the task swaps frameReady with sending.
+  uint8_t frames[3][frameBytes];
+  uint8_t *frameFree = frames[0];
+  uint8_t *frameReady = frames[1];
+  uint8_t *sending = frames[2];
+  uint8_t shown[frameBytes];          // what the display has
+  bool shownValid = false;            // the first frame is sent in full
+  bool framePending = false;
+  portMUX_TYPE frameMux = portMUX_INITIALIZER_UNLOCKED;
+  TaskHandle_t taskHandle = NULL;
+  DisplayCallback frameSent = NULL;
+
+  static void task(void *parameter)
+  {
+    EmmmaDisplay *self = (EmmmaDisplay *)parameter;
+
+    while(true)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+      portENTER_CRITICAL(&self->frameMux);
+
+      bool pending = self->framePending;
+      self->framePending = false;
+
+      if(pending)
+      {
+        uint8_t *ready = self->frameReady;
+        self->frameReady = self->sending;
+        self->sending = ready;
+      }
+
+      portEXIT_CRITICAL(&self->frameMux);
+
+      if(!pending)
+        continue;
+
+      uint32_t start = micros();
+      uint32_t bytes = self->send();
+
+      if(self->frameSent)
+        self->frameSent(micros() - start, bytes);
+    }
+  }
+
+  // Sends the parts of each page that have changed, the same way as Adafruit_SH110X::display(). Returns
+  // the number of display data bytes sent.
+  uint32_t send()
+  {
+    uint8_t dc_byte = 0x40;
+    uint16_t maxbuff = i2c_dev->maxBufferSize() - 1;
+    uint32_t bytes = 0;
+
+    for(int p = 0; p < pages; p++)
+    {
+      const uint8_t *page = sending + p * pageBytes;
+      uint8_t *shownPage = shown + p * pageBytes;
+      int first = 0;
+      int last = pageBytes - 1;
+
+      if(shownValid)
+      {
+        while(first < pageBytes && page[first] == shownPage[first])
+          first++;
+
+        if(first == pageBytes) // nothing changed on this page
+          continue;
+
+        while(page[last] == shownPage[last])
+          last--;
+      }
+
+      uint8_t column = first + _page_start_offset;
+      uint8_t cmd[] = {0x00, (uint8_t)(SH110X_SETPAGEADDR + p), (uint8_t)(0x10 + (column >> 4)), (uint8_t)(column & 0xF)};
+
+      i2c_dev->write(cmd, 4);
+
+      const uint8_t *ptr = page + first;
+      uint16_t remaining = last - first + 1;
+
+      bytes += remaining;
+
+      while(remaining)
+      {
+        uint16_t to_write = min(remaining, maxbuff);
+        i2c_dev->write(ptr, to_write, false, &dc_byte, 1);
+        ptr += to_write;
+        remaining -= to_write;
+      }
+
+      memcpy(shownPage + first, page + first, last - first + 1);
+    }
+
+    shownValid = true;
+
+    return bytes;
+  }
+};
+
+EmmmaDisplay display = EmmmaDisplay(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET, 1000000, 100000);
 
 // ************ The following define should normally be 1 for USB MIDI. Also must set the compile flag in platformio.ini ************
 #define USEMIDI 0 // set to 0 to force remote via wireless (ESP-Now or BLE)
@@ -119,6 +410,16 @@ uint8_t espNowDeliveryStatus = 0xFF;
 
 bool bluetoothConnected = false; // will be set when bluetooth connected
 
+// Counted all the time for the "Stats" mode (see updateStats()), each is no more than an increment
+portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED; // the ESP-Now callback runs in the WiFi task
+LatencyHistogram sendLatency;   // master note pins being read to the note on going out
+LatencyHistogram espNowLatency; // ESP-Now send to the delivery callback
+uint32_t espNowSent = 0;
+uint32_t espNowFailed = 0;
+uint32_t slaveLinkErrors = 0;   // bytes from the slave that came without the other one of the pair
+uint32_t loopCount = 0;
+uint32_t loopWorstMicros = 0;
+
 #define RGBLED 0 // set to 1 to show note colours 
 
 Adafruit_NeoPixel pixels(1, 48, NEO_GRB + NEO_KHZ800); // ESP32-S3 DevKitC
@@ -172,6 +473,221 @@ static const touch_pad_t pins[numPins] =
 
 static uint32_t benchmark[numPins]; // to store the initial touch values of the pins
 
+// Touch measurement profiles (chosen with "Touch Profile" in the config).
+// Each one sets how the touch hardware measures (sleep cycles between sweeps, charge/discharge
+// cycles per measurement, hardware denoise and filter) and the note on and off thresholds that go
+// with it. More charge/discharge cycles and filtering give less noise but a longer sweep period.
+// The sweep period and noise actually seen on the instrument are measured by measureTouchProfile()
+// when a profile is applied and shown in the config.
+struct TouchProfile
+{
+  const char *name;
+  uint16_t sleepCycles;   // RTC slow clock cycles between sweeps
+  uint16_t measTimes;     // charge/discharge cycles for each measurement
+  bool denoise;           // subtract the denoise channel (TOUCH_PAD_NUM0, not used as a pin)
+  bool filter;            // read the hardware IIR filtered value instead of the raw value
+  uint16_t onThreshold;   // default note on and off thresholds in permille above benchmark
+  uint16_t offThreshold;
+};
+
+const TouchProfile touchProfiles[] = 
+{
+  {"Lowest Latency", 1, 250, false, false, 300, 200},
+  {"Balanced", 15, 500, false, false, 300, 200},  // the ESP-IDF defaults
+  {"Noisy Venue", 15, 1000, true, true, 350, 250}
+};
+
+uint8_t touchProfileCount = sizeof(touchProfiles)/sizeof(touchProfiles[0]);
+uint32_t touchSweepMicros = 0;   // measured by measureTouchProfile()
+uint16_t touchNoisePermille = 0; // average standard deviation of the idle pins, in permille of benchmark
+
+// Note on and off thresholds of each pin in permille above its benchmark. Zero means use the thresholds
+// of the touch profile. Pins can be tuned one by one with "Auto Tune Pins" in the config. The raw value
+// levels used by loop() are worked out from these by updateTouchLevels().
+uint16_t onThresholds[numPins] = {0};
+uint16_t offThresholds[numPins] = {0};
+uint32_t touchOnLevel[numPins];
+uint32_t touchOffLevel[numPins];
+
+void updateTouchLevels()
+{
+  for(int i = 0; i < numPins; i++)
+  {
+    uint32_t on = onThresholds[i] ? onThresholds[i] : touchProfiles[touchProfile].onThreshold;
+    uint32_t off = offThresholds[i] ? offThresholds[i] : touchProfiles[touchProfile].offThreshold;
+
+    touchOnLevel[i] = benchmark[i] + benchmark[i] * on / 1000;
+    touchOffLevel[i] = benchmark[i] + benchmark[i] * off / 1000;
+  }
+}
+
+inline void readTouchPin(int i, uint32_t *touch_value)
+{
+  if(touchProfiles[touchProfile].filter)
+    touch_pad_filter_read_smooth(pins[i], touch_value);
+  else
+    touch_pad_read_raw_data(pins[i], touch_value);
+}
+
+// Set up the touch hardware for the current profile. This has to be done with the FSM stopped.
+void touchProfileHardware()
+{
+  const TouchProfile &profile = touchProfiles[touchProfile];
+
+  touch_pad_set_meas_time(profile.sleepCycles, profile.measTimes);
+
+  if(profile.denoise)
+  {
+    touch_pad_denoise_t denoise = {};
+    denoise.grade = TOUCH_PAD_DENOISE_BIT4;
+    denoise.cap_level = TOUCH_PAD_DENOISE_CAP_L4;
+    touch_pad_denoise_set_config(&denoise);
+    touch_pad_denoise_enable();
+  }
+  else
+  {
+    touch_pad_denoise_disable();
+  }
+
+  if(profile.filter)
+  {
+    touch_filter_config_t filter = {};
+    filter.mode = TOUCH_PAD_FILTER_IIR_16;
+    filter.debounce_cnt = 1;
+    filter.noise_thr = 0;
+    filter.jitter_step = 4;
+    filter.smh_lvl = TOUCH_PAD_SMOOTH_IIR_2;
+    touch_pad_filter_set_config(&filter);
+    touch_pad_filter_enable();
+  }
+  else
+  {
+    touch_pad_filter_disable();
+  }
+}
+
+// Measure the sweep period (how often a new reading shows up) and the noise of the pins
+// that aren't being touched. Takes about 250ms.
+void measureTouchProfile()
+{
+  TouchPadStats stats[notePins];
+  uint32_t touch_value;
+  uint32_t lastValue = 0;
+  uint32_t changes = 0;
+
+  for(int i = 0; i < notePins; i++)
+    autoTuneReset(stats[i]);
+
+  uint32_t startMicros = micros();
+
+  while(micros() - startMicros < 250000)
+  {
+    for(int i = 0; i < notePins; i++)
+    {
+      readTouchPin(i, &touch_value);
+      autoTuneIdleSample(stats[i], touch_value);
+
+      if(i == 0 && touch_value != lastValue)
+      {
+        lastValue = touch_value;
+        changes++;
+      }
+    }
+  }
+
+  touchSweepMicros = changes ? 250000 / changes : 0;
+
+  double noise = 0.0;
+  int quietPins = 0;
+
+  for(int i = 0; i < notePins; i++)
+  {
+    double mean = stats[i].idleSum / stats[i].idleCount;
+
+    if(mean < touchOffLevel[i]) // skip any pin being touched
+    {
+      double variance = stats[i].idleSumSq / stats[i].idleCount - mean * mean;
+      noise += (variance > 0.0 ? sqrt(variance) : 0.0) * 1000.0 / benchmark[i];
+      quietPins++;
+    }
+  }
+
+  touchNoisePermille = quietPins ? (uint16_t)(noise / quietPins + 0.5) : 0;
+
+  Serial.printf("Touch profile %s: sweep %uus noise %u permille\n", touchProfiles[touchProfile].name, touchSweepMicros, touchNoisePermille);
+}
+
+// Switch touch profiles on the fly. The raw values scale with the number of charge/discharge
+// cycles so the benchmarks are scaled to suit and then re-read for the pins that aren't touched.
+void applyTouchProfile(uint8_t oldProfile)
+{
+  touch_pad_fsm_stop();
+  touchProfileHardware();
+  touch_pad_fsm_start();
+
+  delay(100); // let a few sweeps go by
+
+  uint32_t touch_value;
+
+  for(int i = 0; i < numPins; i++)
+  {
+    uint32_t expected = (uint64_t)benchmark[i] * touchProfiles[touchProfile].measTimes / touchProfiles[oldProfile].measTimes;
+
+    readTouchPin(i, &touch_value);
+
+    if(touch_value < expected + expected / 10)
+      benchmark[i] = touch_value;
+    else
+      benchmark[i] = expected; // probably being touched
+  }
+
+  updateTouchLevels();
+  measureTouchProfile();
+}
+
+// Cross-talk compensation (enabled with "Crosstalk Comp" in the config, see crosstalk.h).
+// The 9 master note pins are laid out side by side so master pin i only leaks into pins i - 1
+// and i + 1. The coupling is calibrated with "Calibrate X-Talk" and with it on the adjacent pin
+// filter no longer has to block neighbouring master pins.
+CrosstalkMatrix crosstalk = {};
+uint32_t crosstalkCycles = 0; // CPU cycles the last compensation took
+
+void compensateCrosstalk(uint32_t *touchValues)
+{
+  static int16_t delta[CROSSTALK_LANES + 2] = {0};
+  static int16_t compensated[CROSSTALK_LANES];
+
+  uint32_t startCycles = ESP.getCycleCount();
+
+  for(int i = 0; i < notePins; i++)
+  {
+    int32_t d = (int32_t)touchValues[i] - (int32_t)benchmark[i];
+
+    if(d > 32767)
+      d = 32767;
+    else if(d < -32768)
+      d = -32768;
+
+    delta[i + 1] = d;
+  }
+
+  crosstalkCompensate(crosstalk, delta, compensated);
+
+  for(int i = 0; i < notePins; i++)
+  {
+    int32_t value = (int32_t)benchmark[i] + compensated[i];
+
+    touchValues[i] = value > 0 ? value : 0;
+  }
+
+  crosstalkCycles = ESP.getCycleCount() - startCycles;
+}
+
+bool crosstalkCompensated()
+{
+  return crosstalkCompensation && crosstalkActive(crosstalk);
+}
+
 // notes (17 total) and scales (choose one)
 uint8_t majorscale[] = {2, 2, 1, 2, 2, 2, 1}; // case 1
 uint8_t minorscale[] = {2, 1, 2, 2, 1, 2, 2}; // case 2
@@ -197,6 +713,22 @@ uint8_t wholehalfdiminished[] = {2, 1, 2, 1, 2, 1, 2, 1}; // case 18
 uint8_t halfwholediminished[] = {1, 2, 1, 2, 1, 2, 1, 2}; // case 19
 uint8_t chromatic[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}; // case 20
 
+// The step tables in the same order as scales[] (CC 68 value - 1)
+struct ScaleSteps
+{
+  const uint8_t *steps;
+  uint8_t size;
+};
+
+#define SCALE_STEPS(s) {s, sizeof(s)}
+
+const ScaleSteps scaleSteps[] = {SCALE_STEPS(majorscale), SCALE_STEPS(minorscale), SCALE_STEPS(pentascale),
+  SCALE_STEPS(minorpentascale), SCALE_STEPS(majorbluesscale), SCALE_STEPS(minorbluesscale),
+  SCALE_STEPS(minorharmonic), SCALE_STEPS(minormelodic), SCALE_STEPS(minorpo33), SCALE_STEPS(dorian),
+  SCALE_STEPS(phrygian), SCALE_STEPS(lydian), SCALE_STEPS(mixolydian), SCALE_STEPS(aeolian),
+  SCALE_STEPS(locrian), SCALE_STEPS(lydiandomiant), SCALE_STEPS(superlocrian),
+  SCALE_STEPS(wholehalfdiminished), SCALE_STEPS(halfwholediminished), SCALE_STEPS(chromatic)};
+
 const int totalNotePins = 17; // 17 note pins on the keyboard itself 
 const int totalNotes = 24;    // 17 notes plus room for chord notes above the last one including inversions
 
@@ -210,1040 +742,2960 @@ bool option1 = false; // right top (on PCB) option pin (pitchbend)
 bool option2 = false; // right middle (on PCB) option pin (mode value up)
 bool option3 = false; // right bottom (on PCB) option pin (mode value down)
 bool option4 = false; // left top (on PCB) option pin (3 functions: change relative scale, enable/disable chords, modwheel)
-bool option5 = false; // left middle (on PCB) option pin (not used)
+bool option5 = false; // left middle (on PCB) option pin (presets)
 bool option6 = false; // left bottom (on PCB) option pin (2 functions: change mode and change config)
 
-void displayValue(String title, String value);
-String keyNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+void displayValue(const char *title, const char *value);
 
-String mode = "Scale";
-String scales[] = {"Major", "Minor", "Major Pentatonic", "Minor Pentatonic", 
+// The modes option6 steps through
+enum Mode
+{
+  MODE_SCALE = 0,
+  MODE_KEY,
+  MODE_OCTAVE,
+  MODE_NOTE,
+  MODE_STATS
+};
+
+uint8_t mode = MODE_SCALE;
+const char *scales[] = {"Major", "Minor", "Major Pentatonic", "Minor Pentatonic", 
   "Major Blues", "Minor Blues", "Minor Harmonic", "Minor Melodic", "Minor PO-33", "Dorian",
   "Phrygian", "Lydian", "Mixolydian", "Aeolian", "Locrian",
   "Lydian Dominished", "Super Locrian", "Whole Half Dim", "Half Whole Dim", "Chromatic"};
 
 int scaleCount = sizeof(scales)/sizeof(scales[0]); 
 
+bool scaleIs(const char *name)
+{
+  return !strcmp(scales[scaleIndex], name);
+}
+
 bool playChords = false;
 
 bool notePlayedWhileOption4Touched = false;
 
-//String config = "Adjacent Key Filt";
 uint8_t config = 0;
-String configs[] = {"Adjacent Pin Filt", "Dissnt Notes Filt", "MIDI Channel", "Master Volume",
-  "CC for Modwheel", "Wireless Mode", "Save & Exit", "Exit NO Save"};
+const char *configs[] = {"Adjacent Pin Filt", "Dissnt Notes Filt", "MIDI Channel", "Master Volume",
+  "CC for Modwheel", "Hi-Res CC", "Wireless Mode", "Pressure Output", "Auto Tune Pins", "Touch Profile", "Crosstalk Comp", "Calibrate X-Talk",
+  "Bend Curve", "Bend Range", "Mod Curve", "Mod Range", "Yaw Output", "Yaw Curve", "Yaw Range", "IMU Mode", "Calibrate IMU",
+  "Tap Action", "Shake Action", "Flick Up Action", "Flick Dn Action", "Save & Exit", "Exit NO Save"};
 uint8_t numberOfConfigItems = sizeof(configs)/sizeof(configs[0]);
 void displayAdjacentPinFilt();
 void displayDissonantNotesFilt();
 void displayMidiChannel();
 void displayMasterVolume();
 void displayCcForModwheel();
+void displayHighResCc();
 void displayWirelessMode();
+void displayPressureMode();
+void displayAutoTune();
+void displayTouchProfile();
+void displayCrosstalkCompensation();
+void displayCrosstalkCalibration();
+void displayBendCurve();
+void displayBendRange();
+void displayModCurve();
+void displayModRange();
+void displayYawOutput();
+void displayYawCurve();
+void displayYawRange();
+void displayImuMode();
+void displayImuCalibration();
+void displayTapAction();
+void displayShakeAction();
+void displayFlickUpAction();
+void displayFlickDownAction();
 void displaySaveExitPrompt();
 void displayExitNoSavePrompt();
 void (*configDisplayFunctions[])() = {displayAdjacentPinFilt, displayDissonantNotesFilt, displayMidiChannel, displayMasterVolume,
-  displayCcForModwheel, displayWirelessMode, displaySaveExitPrompt, displayExitNoSavePrompt};
+  displayCcForModwheel, displayHighResCc, displayWirelessMode, displayPressureMode, displayAutoTune, displayTouchProfile, displayCrosstalkCompensation, displayCrosstalkCalibration,
+  displayBendCurve, displayBendRange, displayModCurve, displayModRange, displayYawOutput, displayYawCurve, displayYawRange, displayImuMode, displayImuCalibration,
+  displayTapAction, displayShakeAction, displayFlickUpAction, displayFlickDownAction, displaySaveExitPrompt, displayExitNoSavePrompt};
 void changeAdjacentPinFilt(bool up);
 void changeDissonantNotesFilt(bool up);
 void changeMidiChannel(bool up);
 void changeMasterVolume(bool up);
 void changeCcForModwheel(bool up);
+void changeHighResCc(bool up);
+void compileRoutes();
 void changeWirelessMode(bool up);
+void changePressureMode(bool up);
+void changeAutoTune(bool up);
+void changeTouchProfile(bool up);
+void changeCrosstalkCompensation(bool up);
+void changeCrosstalkCalibration(bool up);
+void changeBendCurve(bool up);
+void changeBendRange(bool up);
+void changeModCurve(bool up);
+void changeModRange(bool up);
+void changeYawOutput(bool up);
+void changeYawCurve(bool up);
+void changeYawRange(bool up);
+void changeImuMode(bool up);
+void changeImuCalibration(bool up);
+void changeTapAction(bool up);
+void changeShakeAction(bool up);
+void changeFlickUpAction(bool up);
+void changeFlickDownAction(bool up);
 void saveExitConfig(bool up);
 void exitNoSaveConfig(bool up);
 void saveConfig();
+void restartAfterSave();
+bool allNotesOff();
 void (*configChangeFunctions[])(bool) = {changeAdjacentPinFilt, changeDissonantNotesFilt, changeMidiChannel, changeMasterVolume,
-  changeCcForModwheel, changeWirelessMode, saveExitConfig, exitNoSaveConfig};
+  changeCcForModwheel, changeHighResCc, changeWirelessMode, changePressureMode, changeAutoTune, changeTouchProfile, changeCrosstalkCompensation, changeCrosstalkCalibration,
+  changeBendCurve, changeBendRange, changeModCurve, changeModRange, changeYawOutput, changeYawCurve, changeYawRange, changeImuMode, changeImuCalibration,
+  changeTapAction, changeShakeAction, changeFlickUpAction, changeFlickDownAction, saveExitConfig, exitNoSaveConfig};
+
+// The notes and chords display is drawn by the UI task (see uiTask()) so everything else that draws
+// holds displayMutex while it does. It is recursive so the UI task can hold it around displayValue().
+SemaphoreHandle_t displayMutex = NULL;
+
+void displayLock()
+{
+  if(displayMutex)
+    xSemaphoreTakeRecursive(displayMutex, portMAX_DELAY);
+}
+
+void displayUnlock()
+{
+  if(displayMutex)
+    xSemaphoreGiveRecursive(displayMutex);
+}
+
+// What displayValue() last drew is kept so that it can be drawn again after a pop-up message (see
+// displayMessage()). displayGeneration goes up every time so a pop-up can tell if it has been replaced.
+// The text is copied into fixed buffers, nothing on the display side uses the heap.
+#define DISPLAY_TITLE_SIZE 24
+#define DISPLAY_VALUE_SIZE 120 // the most that fits on the screen
 
+char baseTitle[DISPLAY_TITLE_SIZE];
+char baseValue[DISPLAY_VALUE_SIZE];
+uint32_t displayGeneration = 0;
 
-void displayValue(String title, String value)
+void drawValue(const char *title, const char *value)
 {
   display.clearDisplay();
   display.setCursor(15,20);
-  display.print(title + ":");
-  if(value.length() > 15)
+  display.printCached(title);
+  display.printCached(":");
+  if(strlen(value) > 15)
     display.setCursor(15, 40);
   else
     display.setCursor(30, 40);
-  display.print(value);
+  display.printCached(value);
   display.display();
 }
 
-void displayScale()     
+void displayValue(const char *title, const char *value)
 {
-  displayValue(String("SCALE") + " " + String(scaleIndex + 1) + "/" + String(scaleCount), String(scales[scaleIndex]));
-}
+  displayLock();
 
-void displayKey()
-{
-  displayValue(String("KEY"), keyNames[key]);
-}
+  strlcpy(baseTitle, title, sizeof(baseTitle));
+  strlcpy(baseValue, value, sizeof(baseValue));
+  displayGeneration++;
 
-void displayOctave()
-{
-  displayValue(String("OCTAVE"), String(octave));
+  drawValue(baseTitle, baseValue);
+
+  displayUnlock();
 }
 
-void displayNotes(bool init)
+// displayValue() with the value made by printf() formatting
+void displayValuef(const char *title, const char *format, ...)
 {
-  if(init)
-  {
-    displayValue(String("NOTES"), "none");
-  }
-  else if(mode == "Note")
-  {
-    String noteNames = "";
-
-    for(int i = 0; i < totalNotePins; i++)
-    {
-      if(notePinsOn[i])
-      {
-        uint8_t midiValue = midiValues[i] + octave * 12 + key;
-        uint8_t idx = midiValue % 60;
-        noteNames += String(keyNames[idx % 12]) + String(midiValue/12 - 2);
-
-        if(i < totalNotePins - 1)
-          noteNames += " ";
-      }
-    }
+  char value[DISPLAY_VALUE_SIZE];
+  va_list args;
 
-    if(noteNames != "") // Only display elapsed time if notes to display
-    {
-      if(espNowReturnTime) // are we using wireless (espNowReturnTime is nonzero)?
-      {
-        if(espNowReturnTime == 0xFFFFFFFF)
-          noteNames += " Fail!";
-        else
-          noteNames += " " + String(espNowReturnTime);
-      }
-    }
+  va_start(args, format);
+  vsnprintf(value, sizeof(value), format, args);
+  va_end(args);
 
-    displayValue(String("NOTES"), noteNames);
-    //Serial.println(espNowReturnTime);
-  } 
+  displayValue(title, value);
 }
 
-void displayAdjacentPinFilt()     
+void displayScale()     
 {
-  if(adjacentPinsFilter)
-    displayValue(String(configs[config]), String(" On"));
-  else
-    displayValue(String(configs[config]), String(" Off"));
+  char title[DISPLAY_TITLE_SIZE];
+
+  snprintf(title, sizeof(title), "SCALE %d/%d", scaleIndex + 1, scaleCount);
+  displayValue(title, scales[scaleIndex]);
 }
 
-void displayDissonantNotesFilt()     
+void displayKey()
 {
-  if(dissonantNotesFilter)
-    displayValue(String(configs[config]), String(" On"));
-  else
-    displayValue(String(configs[config]), String(" Off"));
+  displayValue("KEY", keyNames[key]);
 }
 
-void displayMidiChannel()     
+void displayOctave()
 {
-  displayValue(String(configs[config]), String(" ") + String(midiChannel));
+  displayValuef("OCTAVE", "%d", octave);
 }
 
-void displayMasterVolume()     
-{
-  displayValue(String(configs[config]), String(" ") + String(masterVolume));
-}
+// The names of all the MIDI notes, made once at boot so the notes display doesn't build them every time
+// (see note_names.h)
+char noteNames[128][NOTE_NAME_SIZE];
 
-void displayCcForModwheel()     
-{
-  displayValue(String(configs[config]), String(" ") + String(ccForModwheel));
-}
+#define notesOnTextSize (totalNotePins * NOTE_NAME_SIZE + 1)
 
-void displayWirelessMode()     
+void notesOnText(char *text, size_t size)
 {
-  if(useBluetooth)
-    displayValue(String(configs[config]), String(" ") + "BLE");
-  else
-    displayValue(String(configs[config]), String(" ") + "ESP-Now");
+  notesOnText(text, size, noteNames, notePinsOn, midiValues, totalNotePins, octave * 12 + key);
 }
 
-void displaySaveExitPrompt()
-{
-  displayValue(String("Save & Exit"), String("->"));
-}  
-
-void displayExitNoSavePrompt()
-{
-  displayValue(String("Exit NO Save"), String("->"));
-}  
-
-bool chordSupported()
+// Renders the worst case notes display (every pin on) with print() and then with the glyph cache and
+// prints the times. Nothing is sent to the display. Only with DISPLAY_STATS.
+void benchmarkNotesDisplay()
 {
-  String s = String(scales[scaleIndex]);
+#if DISPLAY_STATS
+  char text[notesOnTextSize];
+  size_t length = 0;
 
-  bool result = (s == "Major") || (s == "Minor") || (s == "Major Pentatonic") ||
-    (s == "Minor Pentatonic") || (s == "Minor Blues");
+  for(int i = 0; i < totalNotePins; i++)
+    length += snprintf(text + length, sizeof(text) - length, "%s ", noteNames[60 + i]);
 
-  return result;
-}
+  const int runs = 20;
+  uint32_t start = micros();
 
-void displayChords(bool init)
-{
-  if(init)
+  for(int run = 0; run < runs; run++)
   {
-    displayValue(String("CHORDS"), "none");
+    display.clearDisplay();
+    display.setCursor(15,20);
+    display.print("NOTES:");
+    display.setCursor(15, 40);
+    display.print(text);
   }
-  else if(mode == "Note")
-  {
-    String keyName = keyNames[key];
-  
-    String chordName = scales[scaleIndex];
 
-    if(chordName == "Major Pentatonic") // Shorten names that are too long...
-      chordName = "Major Penta";
-    else if(chordName == "Minor Pentatonic")
-      chordName = "Minor Penta";
+  uint32_t printMicros = micros() - start;
 
-    chordName = keyName + chordName + " ";
+  start = micros();
 
-    String chordNames = "";
+  for(int run = 0; run < runs; run++)
+  {
+    display.clearDisplay();
+    display.setCursor(15,20);
+    display.printCached("NOTES:");
+    display.setCursor(15, 40);
+    display.printCached(text);
+  }
 
-    for(int i = 0; i < totalNotePins; i++)
-    {
-      if(notePinsOn[i])
-      {
-        uint8_t midiValue = midiValues[i] + octave * 12 + key;
-        uint8_t idx = midiValue % 60;
-        chordNames += String(keyNames[idx % 12]) + String(midiValue/12 - 2);
+  uint32_t cachedMicros = micros() - start;
 
-        if(i < totalNotePins - 1)
-          chordNames += " ";
-      }
-    }
+  display.clearDisplay();
 
-    if(chordNames != "")
-      displayValue(String("CHORDS"), chordName + chordNames);
-    else
-     displayValue(String("CHORDS"), "");
-   }
+  Serial.printf("Notes display with all pins on: print() %uus glyph cache %uus\n", printMicros / runs, cachedMicros / runs);
+#endif
 }
 
-const uint16_t displaySize =  8 * SCREEN_WIDTH * ((SCREEN_HEIGHT + 7) / 8);
-uint8_t displaySaveBuffer[displaySize];
-uint8_t messageSaveBuffer[displaySize];
-
-void messageUpdate(bool init) // call this with init=false from loop()...
+void displayNotes(bool init)
 {
-  static bool displaying = false;
-  static uint32_t delayTime;
-  static uint8_t saveBuffer[displaySize];
-
   if(init)
   {
-    displaying = true;
-    delayTime = millis();
+    displayValue("NOTES", "none");
   }
-  else if(displaying)
+  else // only from the UI task, notesChanged() checks the mode
   {
-    if(millis() - delayTime > 2000)
-    {
-      uint8_t *displayBuffer = (uint8_t *)display.getBuffer();
+    char names[notesOnTextSize + 12];
 
-      // check and see if display buffer has changed (user may have done something)
-      memcpy(saveBuffer, displayBuffer, displaySize);
+    notesOnText(names, notesOnTextSize);
 
-      bool changed = false;
+    if(names[0]) // Only display elapsed time if notes to display
+    {
+      size_t length = strlen(names);
 
-      for(int i = 0; i < displaySize; i++)
+      if(espNowReturnTime) // are we using wireless (espNowReturnTime is nonzero)?
       {
-        if(messageSaveBuffer[i] != saveBuffer[i])
-        {
-          changed = true;
-        }
+        if(espNowReturnTime == 0xFFFFFFFF)
+          snprintf(names + length, sizeof(names) - length, " Fail!");
+        else
+          snprintf(names + length, sizeof(names) - length, " %u", espNowReturnTime);
       }
+    }
 
-      // only restore the old display if it hasn't changed
-      if(!changed)
-      {
-        display.clearDisplay(); // need to do this to mark display dirty
-        memcpy(displayBuffer, displaySaveBuffer, displaySize);
-        display.display();
-      }
+    displayValue("NOTES", names);
+  } 
+}
 
-      displaying = false;
-    }
-  }
+void displayAdjacentPinFilt()     
+{
+  if(adjacentPinsFilter)
+    displayValue(configs[config], " On");
+  else
+    displayValue(configs[config], " Off");
 }
 
-void displayMessage(String message)
+void displayDissonantNotesFilt()     
 {
-  uint8_t *displayBuffer = (uint8_t *)display.getBuffer();
-  memcpy(displaySaveBuffer, displayBuffer, displaySize);
-  
-  display.clearDisplay();
-  display.setCursor(10,20);
-  display.print(message);
-  display.display();
-  
-  memcpy(messageSaveBuffer, displayBuffer, displaySize); // so we see if user changed the display
+  if(dissonantNotesFilter)
+    displayValue(configs[config], " On");
+  else
+    displayValue(configs[config], " Off");
+}
 
-  messageUpdate(true);
+void displayMidiChannel()     
+{
+  displayValuef(configs[config], " %d", midiChannel);
 }
 
-void displayMode()
+void displayMasterVolume()     
 {
-  if(mode == "Key")
-  {
-    displayKey();
-  }
-  else if(mode == "Octave")
-  {
-    displayOctave();
-  }
-  else if(mode == "Note")
-  {
-    if(playChords && chordSupported())
-      displayChords(true);
-    else
-      displayNotes(true);
-  }
-  //else if(mode == "Config")
-  //{
-  //  displayConfigPrompt();
-  //}
-  else if(mode == "Scale")
-  {
-    displayScale();
-  }
+  displayValuef(configs[config], " %d", masterVolume);
 }
 
-void changeMode()
+void displayCcForModwheel()     
 {
-  if(mode == "Scale")
-  {
-    mode = "Key";
-  }
-  else if(mode == "Key")
-  {
-    mode = "Octave";
-  }
-  else if(mode == "Octave")
-  {
-    mode = "Note";
-  }
-  else if(mode == "Note")
-  {
-    mode = "Scale";
-  }
-  //else if(mode == "Config")
-  //{
-  //  mode = "Scale";
-  //}
+  displayValuef(configs[config], " %d", routes[ROUTE_ROLL].param);
+}
 
-  displayMode();
+void displayHighResCc()     
+{
+  if(highResCc)
+    displayValue(configs[config], " 14 bit");
+  else
+    displayValue(configs[config], " Off");
 }
 
-void changeScale(bool up)
+void displayWirelessMode()     
 {
-  if(up)
-  {
-    if(scaleIndex == scaleCount - 1)
-      scaleIndex = 0;
-    else
-      scaleIndex++;
-  }
+  if(useBluetooth)
+    displayValue(configs[config], " BLE");
   else
-  {
-    if(scaleIndex == 0)
-      scaleIndex = scaleCount - 1;
-    else
-      scaleIndex--;
-  }
-  
-  handleChangeRequest(176, 68, scaleIndex + 1);
+    displayValue(configs[config], " ESP-Now");
 }
 
-void changeKey(bool up)
+void displayPressureMode()     
 {
-  if(up)
-  {
-    if(key == 11)
-      key = 0;
-    else
-      key++;
-  }
+  if(pressureMode == 1)
+    displayValue(configs[config], " Poly AT");
+  else if(pressureMode == 2)
+    displayValue(configs[config], " Chan Pressure");
   else
-  {
-    if(key == 0)
-      key = 11;
-    else
-      key--;
-  }
+    displayValue(configs[config], " Off");
 }
 
-void changeOctave(bool up)
+void displayAutoTune()
 {
-  if(up)
+  uint8_t tuned = 0;
+
+  for(int i = 0; i < numPins; i++)
   {
-    if(octave == 5)
-      octave = -5;
-    else
-      octave++;
+    if(onThresholds[i])
+      tuned++;
   }
+
+  if(tuned)
+    displayValuef(configs[config], " %d tuned", tuned);
   else
-  {
-    if(octave == -5)
-      octave = 5;
-    else
-      octave--;
-  }
+    displayValue(configs[config], " Defaults");
 }
 
-void displayConfig()
+void displayTouchProfile()
 {
-  (*configDisplayFunctions[config])();
+  displayValuef(configs[config], "%s %uus n%u", touchProfiles[touchProfile].name, touchSweepMicros, touchNoisePermille);
 }
 
-void changeConfig()
+void displayCrosstalkCompensation()
 {
-  if(config >= numberOfConfigItems - 1)
-    config = 0;
+  if(crosstalkCompensation)
+    displayValuef(configs[config], " On %u cycles", crosstalkCycles);
   else
-    config++;
-
-  displayConfig();
+    displayValue(configs[config], " Off");
 }
 
-void changeAdjacentPinFilt(bool up)
+void displayCrosstalkCalibration()
 {
-  if(adjacentPinsFilter)
-    adjacentPinsFilter = false;
+  if(crosstalkActive(crosstalk))
+    displayValue(configs[config], " Calibrated");
   else
-    adjacentPinsFilter = true;
+    displayValue(configs[config], " None");
 }
 
-void changeDissonantNotesFilt(bool up)
+void displayCurve(const AxisSettings &axis)
 {
-  if(dissonantNotesFilter)
-    dissonantNotesFilter = false;
+  const char *invert = axis.invert ? " Inv" : "";
+
+  if(axis.curve == CURVE_EXPO)
+    displayValuef(configs[config], " Expo %d%%%s", axis.amount, invert);
+  else if(axis.curve == CURVE_SCURVE)
+    displayValuef(configs[config], " S-Curve %d%%%s", axis.amount, invert);
   else
-    dissonantNotesFilter = true;
+    displayValuef(configs[config], " Linear%s", invert);
 }
 
-void changeMidiChannel(bool up)
+void displayBendCurve()
 {
-  if(up)
-  {
-    if(midiChannel == 16)
-      midiChannel = 1;
-    else
-      midiChannel++;
-  }
-  else
-  {
-    if(midiChannel == 1)
-      midiChannel = 16;
-    else
-      midiChannel--;
-  }
+  displayCurve(routes[ROUTE_PITCH].axis);
 }
 
-void changeMasterVolume(bool up)
+void displayBendRange()
 {
-  if(up)
-  {
-    if(masterVolume >= 127)
-      masterVolume = 7;
-    else
-      masterVolume += 5;
-  }
-  else
-  {
-    if(masterVolume < 7)
-      masterVolume = 127;
-    else
-      masterVolume -= 5;
-  }
+  displayValuef(configs[config], " %d deg", routes[ROUTE_PITCH].axis.range);
 }
 
-void changeCcForModwheel(bool up)
+void displayModCurve()
 {
-  if(up)
-  {
-    if(ccForModwheel >= 127)
-      ccForModwheel = 1;
-    else
-      ccForModwheel++;
-  }
-  else
-  {
-    if(ccForModwheel <= 1)
-      ccForModwheel = 127;
-    else
-      ccForModwheel--;
-  }
+  displayCurve(routes[ROUTE_ROLL].axis);
 }
 
-void changeWirelessMode(bool up)
+void displayModRange()
 {
-  if(useBluetooth)
-    useBluetooth = false;
-  else
-    useBluetooth = true;
-
-  wirelessChanged = true; // this is going to cause a reset whether or not the config is saved!
+  displayValuef(configs[config], " %d deg", routes[ROUTE_ROLL].axis.range);
 }
 
-void saveExitConfig(bool up)
+void displayYawOutput()
 {
-  // save config here
-  saveConfig();
+  const Route &route = routes[ROUTE_YAW];
+
+  if(route.destination == DEST_PITCH_BEND)
+    displayValue(configs[config], " Pitch Bend");
+  else if(route.destination == DEST_CHANNEL_PRESSURE)
+    displayValue(configs[config], " Chan Pressure");
+  else if(route.destination != DEST_NONE)
+    displayValuef(configs[config], " CC %d", route.param);
+  else
+    displayValue(configs[config], " Off");
+}
 
-  // exit
-  optionsMode = true;
+void displayYawCurve()
+{
+  displayCurve(routes[ROUTE_YAW].axis);
+}
 
-  config = 0; // so we get the start of config next time...
+void displayYawRange()
+{
+  displayValuef(configs[config], " %d deg", routes[ROUTE_YAW].axis.range);
+}
 
-  displayMode();
+void displayImuMode()
+{
+  if(imuMode == IMU_FUSION)
+    displayValue(configs[config], " Fusion");
+  else
+    displayValue(configs[config], " DMP");
+}
 
-  if(wirelessChanged) // need to reboot if wireless was changed whether or not the config was saved
-    ESP.restart();
+void displayImuCalibration()
+{
+  if(imuOffsetsSaved)
+    displayValue(configs[config], " Saved");
+  else
+    displayValue(configs[config], " At boot");
 }
 
-void exitNoSaveConfig(bool up)
+enum GestureAction
 {
-  // exit without saving
-  // This still changes the config but doesn't save it in flash
-  optionsMode = true;
+  ACTION_OFF = 0,
+  ACTION_SUSTAIN,
+  ACTION_OCTAVE_UP,
+  ACTION_OCTAVE_DOWN,
+  ACTION_CC_TOGGLE,
+  ACTION_NOTE,
+  ACTION_NEXT_PRESET
+};
 
-  config = 0; // so we get the start of config next time...
+const char *gestureActionNames[] = {"Off", "Sustain", "Octave Up", "Octave Down", "CC Toggle", "Note", "Next Preset"};
+#define GESTURE_ACTIONS (sizeof(gestureActionNames) / sizeof(gestureActionNames[0]))
 
-  displayMode();
+// gesture is the GestureEvent - 1
+void displayGestureAction(uint8_t gesture)
+{
+  uint8_t action = gestureActions[gesture];
 
-  if(wirelessChanged) // need to reboot if wireless was changed whether or not the config was saved
-    ESP.restart();
+  if(action == ACTION_CC_TOGGLE || action == ACTION_NOTE)
+    displayValuef(configs[config], " %s %d", gestureActionNames[action], gestureParams[gesture]);
+  else
+    displayValuef(configs[config], " %s", gestureActionNames[action]);
 }
 
-void scaleToMidiValues(uint8_t *scale, uint8_t size)
+void displayTapAction()
 {
-  midiValues[0] = 60; // Scales tables always start at middle C thus the first value is 60
+  displayGestureAction(GESTURE_TAP - 1);
+}
+
+void displayShakeAction()
+{
+  displayGestureAction(GESTURE_SHAKE - 1);
+}
+
+void displayFlickUpAction()
+{
+  displayGestureAction(GESTURE_FLICK_UP - 1);
+}
+
+void displayFlickDownAction()
+{
+  displayGestureAction(GESTURE_FLICK_DOWN - 1);
+}
+
+void displaySaveExitPrompt()
+{
+  displayValue("Save & Exit", "->");
+}  
+
+void displayExitNoSavePrompt()
+{
+  displayValue("Exit NO Save", "->");
+}  
+
+bool chordSupported()
+{
+  bool result = scaleIs("Major") || scaleIs("Minor") || scaleIs("Major Pentatonic") ||
+    scaleIs("Minor Pentatonic") || scaleIs("Minor Blues");
+
+  return result;
+}
+
+void displayChords(bool init)
+{
+  if(init)
+  {
+    displayValue("CHORDS", "none");
+  }
+  else // only from the UI task, notesChanged() checks the mode
+  {
+    const char *chordName = scales[scaleIndex];
+
+    if(!strcmp(chordName, "Major Pentatonic")) // Shorten names that are too long...
+      chordName = "Major Penta";
+    else if(!strcmp(chordName, "Minor Pentatonic"))
+      chordName = "Minor Penta";
+
+    char names[notesOnTextSize];
+
+    notesOnText(names, sizeof(names));
+
+    if(names[0])
+      displayValuef("CHORDS", "%s%s %s", keyNames[key], chordName, names);
+    else
+     displayValue("CHORDS", "");
+   }
+}
+
+// A pop-up message is drawn over the screen for 2 seconds and then what displayValue() last drew is drawn
+// again, unless something else has been drawn meanwhile (the user may have done something).
+bool popupShowing = false;
+uint32_t popupMillis;
+uint32_t popupGeneration; // displayGeneration when the pop-up went up
+
+void messageUpdate() // call this from loop()...
+{
+  if(popupShowing && millis() - popupMillis > 2000)
+  {
+    displayLock();
+
+    if(displayGeneration == popupGeneration)
+      drawValue(baseTitle, baseValue);
+
+    displayUnlock();
+
+    popupShowing = false;
+  }
+}
+
+void displayMessage(const char *message)
+{
+  displayLock();
+
+  display.clearDisplay();
+  display.setCursor(10,20);
+  display.print(message);
+  display.display();
+
+  popupGeneration = displayGeneration;
+  popupMillis = millis();
+  popupShowing = true;
+
+  displayUnlock();
+}
+
+// Notes and chords used to be drawn (and the whole frame sent) right in the note on/off path which
+// held up the next note in fast passages. Now the note path just calls notesChanged() and the UI task
+// draws the latest notes at no more than UI_FRAMES_PER_SECOND. It runs at low priority on the other core.
+#define UI_FRAMES_PER_SECOND 25
+
+TaskHandle_t uiTaskHandle = NULL;
+volatile bool notesDirty = false;  // notes or chords need drawing
+volatile bool statsDirty = false;  // the stats screen needs drawing
+volatile bool notesChords = false; // draw them as chords
+
+void drawNotes()
+{
+  if(notesChords)
+    displayChords(false);
+  else
+    displayNotes(false);
+}
+
+// The "Stats" mode screen. updateStats() takes a snapshot of the counters once a second in loop() and
+// starts them again, the UI task draws it so having it open doesn't slow down loop(). The percentiles
+// are over that second and correct to within 12.5% (see latency_histogram.h).
+struct StatsSnapshot
+{
+  uint32_t loopsPerSecond;
+  uint32_t worstLoop;
+  uint32_t send50;
+  uint32_t send99;
+  uint32_t slaveErrors;
+  uint32_t espNowSent;
+  uint32_t espNowFailed;
+  uint32_t rtt50;
+  uint32_t rtt99;
+  uint16_t bleInterval; // 1.25ms units, 0 if not connected
+  uint32_t freeHeap;
+};
+
+StatsSnapshot statsShown;
+
+// Microseconds as milliseconds in no more than 4 characters, to a tenth below 100ms
+void statsMillis(char *text, size_t size, uint32_t us)
+{
+  if(us < 99950)
+    snprintf(text, size, "%u.%u", (us + 50) / 1000, (us + 50) / 100 % 10);
+  else
+    snprintf(text, size, "%u", us < 9999500 ? (us + 500) / 1000 : 9999);
+}
+
+void drawStats()
+{
+  StatsSnapshot s;
+
+  portENTER_CRITICAL(&statsMux);
+  s = statsShown;
+  portEXIT_CRITICAL(&statsMux);
+
+  char lines[8][22]; // 21 characters across
+  char p50[8];
+  char p99[8];
+
+  snprintf(lines[0], sizeof(lines[0]), "Loop %u/s", s.loopsPerSecond);
+  snprintf(lines[1], sizeof(lines[1]), "Worst loop %uus", s.worstLoop);
+  statsMillis(p50, sizeof(p50), s.send50);
+  statsMillis(p99, sizeof(p99), s.send99);
+  snprintf(lines[2], sizeof(lines[2]), "Snd50/99 %s/%sms", p50, p99);
+  snprintf(lines[3], sizeof(lines[3]), "Slave errors %u", s.slaveErrors);
+
+  if(s.espNowSent)
+  {
+    uint32_t permille = (s.espNowSent - s.espNowFailed) * 1000 / s.espNowSent;
+    snprintf(lines[4], sizeof(lines[4]), "ESP-Now %u.%u%% ok", permille / 10, permille % 10);
+  }
+  else
+  {
+    snprintf(lines[4], sizeof(lines[4]), "ESP-Now --");
+  }
+
+  statsMillis(p50, sizeof(p50), s.rtt50);
+  statsMillis(p99, sizeof(p99), s.rtt99);
+  snprintf(lines[5], sizeof(lines[5]), "RTT50/99 %s/%sms", p50, p99);
+
+  if(s.bleInterval)
+    snprintf(lines[6], sizeof(lines[6]), "BLE %u.%02ums", s.bleInterval * 125 / 100, s.bleInterval * 125 % 100);
+  else
+    snprintf(lines[6], sizeof(lines[6]), "BLE --");
+
+  snprintf(lines[7], sizeof(lines[7]), "Heap %u", s.freeHeap);
+
+  displayLock();
+
+  displayGeneration++; // a pop-up won't put back what was there before
+
+  display.clearDisplay();
+
+  for(int i = 0; i < 8; i++)
+  {
+    display.setCursor(0, i * 8);
+    display.printCached(lines[i]);
+  }
+
+  display.display();
+
+  displayUnlock();
+}
+
+void updateStats()
+{
+  static uint32_t lastUpdate = millis();
+
+  uint32_t elapsed = millis() - lastUpdate;
+
+  if(elapsed < 1000)
+    return;
+
+  lastUpdate = millis();
+
+  StatsSnapshot s;
+
+  s.loopsPerSecond = loopCount * 1000 / elapsed;
+  s.worstLoop = loopWorstMicros;
+  s.send50 = histogramPercentile(sendLatency, 50);
+  s.send99 = histogramPercentile(sendLatency, 99);
+  s.slaveErrors = slaveLinkErrors;
+  s.bleInterval = 0;
+  s.freeHeap = ESP.getFreeHeap();
+
+  if(useBluetooth && bluetoothConnected)
+  {
+    NimBLEServer *server = NimBLEDevice::getServer();
+
+    if(server && server->getConnectedCount())
+      s.bleInterval = server->getPeerInfo(0).getConnInterval();
+  }
+
+  loopCount = 0;
+  loopWorstMicros = 0;
+  histogramReset(sendLatency);
+
+  portENTER_CRITICAL(&statsMux);
+
+  s.espNowSent = espNowSent;
+  s.espNowFailed = espNowFailed;
+  s.rtt50 = histogramPercentile(espNowLatency, 50);
+  s.rtt99 = histogramPercentile(espNowLatency, 99);
+
+  espNowSent = 0;
+  espNowFailed = 0;
+  histogramReset(espNowLatency);
+
+  statsShown = s;
+
+  portEXIT_CRITICAL(&statsMux);
+
+  if(mode == MODE_STATS && optionsMode && uiTaskHandle)
+  {
+    statsDirty = true;
+    xTaskNotifyGive(uiTaskHandle);
+  }
+}
+
+void uiTask(void *parameter)
+{
+  uint32_t lastFrame = millis();
+
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint32_t since = millis() - lastFrame;
+
+    if(since < 1000 / UI_FRAMES_PER_SECOND) // the notes that change meanwhile are in this frame
+      vTaskDelay(pdMS_TO_TICKS(1000 / UI_FRAMES_PER_SECOND - since));
+
+    displayLock();
+
+    if(notesDirty) // not if something else has been drawn since
+    {
+      notesDirty = false;
+      drawNotes();
+      lastFrame = millis();
+    }
+
+    if(statsDirty)
+    {
+      statsDirty = false;
+      drawStats();
+      lastFrame = millis();
+    }
+
+    displayUnlock();
+  }
+}
+
+void startUiTask()
+{
+  displayMutex = xSemaphoreCreateRecursiveMutex();
+
+  xTaskCreatePinnedToCore(uiTask, "UI", 4096, NULL, 1, &uiTaskHandle, 0);
+}
+
+// Called from the note path when notes go on or off
+void notesChanged()
+{
+  if(mode != MODE_NOTE)
+    return;
+
+  notesChords = playChords && chordSupported();
+  notesDirty = true;
+
+  if(uiTaskHandle)
+    xTaskNotifyGive(uiTaskHandle);
+  else
+    drawNotes();
+}
+
+void displayMode()
+{
+  displayLock();
+
+  notesDirty = false; // the mode's own display replaces the notes
+  statsDirty = false;
+
+  if(mode == MODE_KEY)
+  {
+    displayKey();
+  }
+  else if(mode == MODE_OCTAVE)
+  {
+    displayOctave();
+  }
+  else if(mode == MODE_NOTE)
+  {
+    if(playChords && chordSupported())
+      displayChords(true);
+    else
+      displayNotes(true);
+  }
+  //else if(mode == "Config")
+  //{
+  //  displayConfigPrompt();
+  //}
+  else if(mode == MODE_SCALE)
+  {
+    displayScale();
+  }
+  else if(mode == MODE_STATS)
+  {
+    drawStats();
+  }
+
+  displayUnlock();
+}
+
+void changeMode()
+{
+  if(mode == MODE_SCALE)
+  {
+    mode = MODE_KEY;
+  }
+  else if(mode == MODE_KEY)
+  {
+    mode = MODE_OCTAVE;
+  }
+  else if(mode == MODE_OCTAVE)
+  {
+    mode = MODE_NOTE;
+  }
+  else if(mode == MODE_NOTE)
+  {
+    mode = MODE_STATS;
+  }
+  else if(mode == MODE_STATS)
+  {
+    mode = MODE_SCALE;
+  }
+  //else if(mode == "Config")
+  //{
+  //  mode = MODE_SCALE;
+  //}
+
+  displayMode();
+}
+
+void changeScale(bool up)
+{
+  if(up)
+  {
+    if(scaleIndex == scaleCount - 1)
+      scaleIndex = 0;
+    else
+      scaleIndex++;
+  }
+  else
+  {
+    if(scaleIndex == 0)
+      scaleIndex = scaleCount - 1;
+    else
+      scaleIndex--;
+  }
+  
+  handleChangeRequest(176, 68, scaleIndex + 1);
+}
+
+void changeKey(bool up)
+{
+  if(up)
+  {
+    if(key == 11)
+      key = 0;
+    else
+      key++;
+  }
+  else
+  {
+    if(key == 0)
+      key = 11;
+    else
+      key--;
+  }
+}
+
+void changeOctave(bool up)
+{
+  if(up)
+  {
+    if(octave == 5)
+      octave = -5;
+    else
+      octave++;
+  }
+  else
+  {
+    if(octave == -5)
+      octave = 5;
+    else
+      octave--;
+  }
+}
+
+void displayConfig()
+{
+  (*configDisplayFunctions[config])();
+}
+
+void changeConfig()
+{
+  if(config >= numberOfConfigItems - 1)
+    config = 0;
+  else
+    config++;
+
+  displayConfig();
+}
+
+void changeAdjacentPinFilt(bool up)
+{
+  if(adjacentPinsFilter)
+    adjacentPinsFilter = false;
+  else
+    adjacentPinsFilter = true;
+}
+
+void changeDissonantNotesFilt(bool up)
+{
+  if(dissonantNotesFilter)
+    dissonantNotesFilter = false;
+  else
+    dissonantNotesFilter = true;
+}
+
+void changeMidiChannel(bool up)
+{
+  if(up)
+  {
+    if(midiChannel == 16)
+      midiChannel = 1;
+    else
+      midiChannel++;
+  }
+  else
+  {
+    if(midiChannel == 1)
+      midiChannel = 16;
+    else
+      midiChannel--;
+  }
+}
+
+void changeMasterVolume(bool up)
+{
+  if(up)
+  {
+    if(masterVolume >= 127)
+      masterVolume = 7;
+    else
+      masterVolume += 5;
+  }
+  else
+  {
+    if(masterVolume < 7)
+      masterVolume = 127;
+    else
+      masterVolume -= 5;
+  }
+}
+
+void changeCcForModwheel(bool up)
+{
+  uint8_t &ccForModwheel = routes[ROUTE_ROLL].param;
+
+  if(up)
+  {
+    if(ccForModwheel >= 127)
+      ccForModwheel = 1;
+    else
+      ccForModwheel++;
+  }
+  else
+  {
+    if(ccForModwheel <= 1)
+      ccForModwheel = 127;
+    else
+      ccForModwheel--;
+  }
+
+  compileRoutes();
+}
+
+void changeHighResCc(bool up)
+{
+  if(highResCc)
+    highResCc = false;
+  else
+    highResCc = true;
+
+  compileRoutes();
+}
+
+void changeWirelessMode(bool up)
+{
+  if(useBluetooth)
+    useBluetooth = false;
+  else
+    useBluetooth = true;
+
+  wirelessChanged = true; // this is going to cause a reset whether or not the config is saved!
+}
+
+void changePressureMode(bool up)
+{
+  if(up)
+  {
+    if(pressureMode >= 2)
+      pressureMode = 0;
+    else
+      pressureMode++;
+  }
+  else
+  {
+    if(pressureMode == 0)
+      pressureMode = 2;
+    else
+      pressureMode--;
+  }
+}
+
+// Auto tune measures the noise of each pin with nobody touching it and then the touch delta while
+// the player touches every pin, and works out new thresholds for the pins that were touched
+// (see touch_autotune.h). Up runs it and down puts all the pins back to the profile thresholds.
+// The new thresholds are used right away and are saved with Save & Exit. Pins that aren't tuned
+// use the thresholds of the touch profile.
+const uint8_t autoTunePins = 12; // the 9 note pins and the 3 right option pins
+const double autoTuneFalseTriggersPerHour = 0.1; // for each pin
+
+void changeAutoTune(bool up)
+{
+  if(!up)
+  {
+    for(int i = 0; i < numPins; i++)
+    {
+      onThresholds[i] = 0;
+      offThresholds[i] = 0;
+    }
+
+    updateTouchLevels();
+
+    return;
+  }
+
+  static TouchPadStats stats[numPins];
+  uint32_t touch_value;
+
+  for(int i = 0; i < numPins; i++)
+    autoTuneReset(stats[i]);
+
+  displayValue("AUTO TUNE", "Hands off...");
+
+  // wait for all the pins (including the option pin that started this) to be let go
+  uint32_t startMillis = millis();
+  uint32_t quietMillis = millis();
+
+  while(millis() - quietMillis < 500 && millis() - startMillis < 5000)
+  {
+    for(int i = 0; i < autoTunePins; i++)
+    {
+      readTouchPin(i, &touch_value);
+
+      if(touch_value > touchOffLevel[i])
+        quietMillis = millis();
+    }
+
+    delay(1);
+  }
+
+  // measure the noise
+  startMillis = millis();
+
+  while(millis() - startMillis < 3000)
+  {
+    for(int i = 0; i < autoTunePins; i++)
+    {
+      readTouchPin(i, &touch_value);
+      autoTuneIdleSample(stats[i], touch_value);
+    }
+  }
+
+  // Most reads return the same sweep again so the samples per second are sweeps, as measured by
+  // measureTouchProfile() at boot and on each profile change (taken as 1ms if that found none)
+  double samplesPerSecond = 1e6 / (touchSweepMicros ? touchSweepMicros : 1000);
+
+  // and the touch deltas
+  displayValue("AUTO TUNE", "Touch every pin");
+
+  startMillis = millis();
+
+  while(millis() - startMillis < 10000)
+  {
+    for(int i = 0; i < autoTunePins; i++)
+    {
+      readTouchPin(i, &touch_value);
+      autoTuneTouchSample(stats[i], touch_value);
+    }
+  }
+
+  double falseTriggerRate = autoTuneFalseTriggersPerHour / (samplesPerSecond * 3600.0);
+  int tuned = 0;
+
+  for(int i = 0; i < autoTunePins; i++)
+  {
+    // only tune the pins that were touched (at least 10% above benchmark)
+    if(stats[i].touchPeak > benchmark[i] + benchmark[i] / 10)
+    {
+      bool met = autoTuneThresholds(stats[i], benchmark[i], falseTriggerRate, onThresholds[i], offThresholds[i]);
+
+      Serial.printf("Pin %d: on %u off %u%s\n", i, onThresholds[i], offThresholds[i], met ? "" : " (noisy)");
+
+      tuned++;
+    }
+  }
+
+  updateTouchLevels();
+
+  displayValuef("AUTO TUNE", " %d/%d tuned", tuned, autoTunePins);
+
+  delay(1500);
+}
+
+void changeTouchProfile(bool up)
+{
+  uint8_t oldProfile = touchProfile;
+
+  if(up)
+  {
+    if(touchProfile >= touchProfileCount - 1)
+      touchProfile = 0;
+    else
+      touchProfile++;
+  }
+  else
+  {
+    if(touchProfile == 0)
+      touchProfile = touchProfileCount - 1;
+    else
+      touchProfile--;
+  }
+
+  applyTouchProfile(oldProfile);
+}
+
+void changeCrosstalkCompensation(bool up)
+{
+  if(crosstalkCompensation)
+    crosstalkCompensation = false;
+  else
+    crosstalkCompensation = true;
+}
+
+// Calibrate the cross-talk between the master note pins. The player touches each note pin on its
+// own for a while, the readings of its neighbours at the same time give the coupling. Up runs
+// it and down clears the calibration.
+void changeCrosstalkCalibration(bool up)
+{
+  if(!up)
+  {
+    crosstalk = CrosstalkMatrix();
+    return;
+  }
+
+  static CrosstalkCalibration cal;
+  int16_t delta[CROSSTALK_LANES + 2] = {0};
+  uint32_t touch_value;
+
+  crosstalkCalibrationReset(cal);
+
+  displayValue("CROSSTALK", "Touch each note pin alone");
+
+  uint32_t startMillis = millis();
+
+  while(millis() - startMillis < 15000)
+  {
+    bool on[notePins];
+
+    for(int i = 0; i < notePins; i++)
+    {
+      readTouchPin(i, &touch_value);
+
+      int32_t d = (int32_t)touch_value - (int32_t)benchmark[i];
+      delta[i + 1] = d > 32767 ? 32767 : (d < -32768 ? -32768 : d);
+      on[i] = touch_value > touchOnLevel[i];
+    }
+
+    // a neighbour over its on level is kept, the strong couplings are the ones that matter most
+    int touched = crosstalkCalibrationPad(delta, on, notePins);
+
+    if(touched >= 0)
+      crosstalkCalibrationSample(cal, delta, touched, notePins);
+  }
+
+  int found = crosstalkCalibrationSolve(cal, crosstalk, 200);
+
+  for(int i = 0; i < notePins; i++)
+    Serial.printf("Pin %d: left %d right %d (Q15)\n", i, crosstalk.left[i], crosstalk.right[i]);
+
+  displayValuef("CROSSTALK", " %d couplings", found);
+
+  delay(1500);
+}
+
+// The routes are compiled into a flat array with their curve tables (see controller_curves.h) built here
+// whenever they change so that the updates never have to look at the config or do the maths.
+CompiledRoute compiledRoutes[MAX_ROUTES];
+uint8_t compiledRouteCount = 0;
+bool yawRouted = false;      // only work out yaw if something uses it
+bool pressureRouted = false; // same for the pin pressures
+bool option5Routed = false;  // option5 is only for the presets if no route uses it
+
+void compileRoutes()
+{
+  compiledRouteCount = routesCompile(routes, routeCount, compiledRoutes, highResCc);
+  yawRouted = routesUse(compiledRoutes, compiledRouteCount, SOURCE_YAW);
+  pressureRouted = routesUse(compiledRoutes, compiledRouteCount, SOURCE_PRESSURE);
+  option5Routed = routesUse(compiledRoutes, compiledRouteCount, SOURCE_OPTION5);
+}
+
+void changeAxisCurve(AxisSettings &axis, bool up)
+{
+  if(up)
+  {
+    if(axis.curve >= CURVE_TYPES - 1)
+      axis.curve = 0;
+    else
+      axis.curve++;
+  }
+  else
+  {
+    if(axis.curve == 0)
+      axis.curve = CURVE_TYPES - 1;
+    else
+      axis.curve--;
+  }
+
+  compileRoutes();
+}
+
+void changeAxisRange(AxisSettings &axis, bool up)
+{
+  const uint8_t minRange = 10;
+  const uint8_t maxRange = 60;
+
+  if(up)
+  {
+    if(axis.range < maxRange)
+      axis.range += 5;
+  }
+  else
+  {
+    if(axis.range > minRange)
+      axis.range -= 5;
+  }
+
+  compileRoutes();
+}
+
+void changeBendCurve(bool up)
+{
+  changeAxisCurve(routes[ROUTE_PITCH].axis, up);
+}
+
+void changeBendRange(bool up)
+{
+  changeAxisRange(routes[ROUTE_PITCH].axis, up);
+}
+
+void changeModCurve(bool up)
+{
+  changeAxisCurve(routes[ROUTE_ROLL].axis, up);
+}
+
+void changeModRange(bool up)
+{
+  changeAxisRange(routes[ROUTE_ROLL].axis, up);
+}
+
+// Off, CC 1 to 127 then pitch bend. Yaw is bipolar so a CC sits at 64 when it's straight ahead.
+void changeYawOutput(bool up)
+{
+  Route &route = routes[ROUTE_YAW];
+  uint8_t yawOutput = 0; // 0 is off, 1 - 127 is a CC number and 128 is pitch bend
+
+  if(route.destination == DEST_PITCH_BEND)
+    yawOutput = 128;
+  else if(route.destination == DEST_CC || route.destination == DEST_CC14)
+    yawOutput = route.param;
+
+  if(up)
+  {
+    if(yawOutput >= 128)
+      yawOutput = 0;
+    else
+      yawOutput++;
+  }
+  else
+  {
+    if(yawOutput == 0)
+      yawOutput = 128;
+    else
+      yawOutput--;
+  }
+
+  if(yawOutput == 128)
+  {
+    route.destination = DEST_PITCH_BEND;
+    route.param = 0;
+  }
+  else if(yawOutput)
+  {
+    route.destination = DEST_CC;
+    route.param = yawOutput;
+  }
+  else
+  {
+    route.destination = DEST_NONE;
+  }
+
+  route.flags &= ~ROUTE_ABSOLUTE;
+
+  compileRoutes();
+}
+
+void changeYawCurve(bool up)
+{
+  changeAxisCurve(routes[ROUTE_YAW].axis, up);
+}
+
+void changeYawRange(bool up)
+{
+  changeAxisRange(routes[ROUTE_YAW].axis, up);
+}
+
+void changeImuMode(bool up)
+{
+  if(imuMode == IMU_FUSION)
+    imuMode = IMU_DMP;
+  else
+    imuMode = IMU_FUSION;
+
+  imuModeChanged = true; // the MPU6050 is only set up at boot so this is going to cause a reset too
+}
+
+void changeGestureAction(uint8_t gesture, bool up)
+{
+  if(up)
+  {
+    if(gestureActions[gesture] >= GESTURE_ACTIONS - 1)
+      gestureActions[gesture] = 0;
+    else
+      gestureActions[gesture]++;
+  }
+  else
+  {
+    if(gestureActions[gesture] == 0)
+      gestureActions[gesture] = GESTURE_ACTIONS - 1;
+    else
+      gestureActions[gesture]--;
+  }
+}
+
+void changeTapAction(bool up)
+{
+  changeGestureAction(GESTURE_TAP - 1, up);
+}
+
+void changeShakeAction(bool up)
+{
+  changeGestureAction(GESTURE_SHAKE - 1, up);
+}
+
+void changeFlickUpAction(bool up)
+{
+  changeGestureAction(GESTURE_FLICK_UP - 1, up);
+}
+
+void changeFlickDownAction(bool up)
+{
+  changeGestureAction(GESTURE_FLICK_DOWN - 1, up);
+}
+
+// Recalibrate the MPU6050. The IMU task does it as it owns the I2C bus, this just waits. Up runs it
+// (the new offsets are kept if the config is saved) and down forgets the saved offsets so the full
+// calibration runs at every boot again.
+void changeImuCalibration(bool up)
+{
+  if(!up)
+  {
+    imuOffsetsSaved = false;
+    return;
+  }
+
+  displayValue("CALIBRATE IMU", "Lay flat & still");
+
+  delay(2000); // time to put it down
+
+  imuCalibrateRequest = true;
+
+  uint32_t startMillis = millis();
+
+  while(imuCalibrateRequest && millis() - startMillis < 10000)
+    delay(10);
+
+  if(imuCalibrateRequest)
+  {
+    imuCalibrateRequest = false;
+    displayValue("CALIBRATE IMU", " Failed");
+  }
+  else
+  {
+    displayValue("CALIBRATE IMU", " Done");
+  }
+
+  delay(1500);
+}
+
+void saveExitConfig(bool up)
+{
+  // save config here
+  saveConfig();
+
+  // exit
+  optionsMode = true;
+
+  config = 0; // so we get the start of config next time...
+
+  displayMode();
+
+  if(wirelessChanged || imuModeChanged) // need to reboot if wireless was changed whether or not the config was saved
+    restartAfterSave();
+}
+
+void exitNoSaveConfig(bool up)
+{
+  // exit without saving
+  // This still changes the config but doesn't save it in flash
+  optionsMode = true;
+
+  config = 0; // so we get the start of config next time...
+
+  displayMode();
+
+  if(wirelessChanged || imuModeChanged) // need to reboot if wireless was changed whether or not the config was saved
+    restartAfterSave();
+}
+
+void scaleToMidiValues(uint8_t *values, int scale)
+{
+  const uint8_t *steps = scaleSteps[scale].steps;
+  uint8_t size = scaleSteps[scale].size;
+
+  values[0] = 60; // Scales tables always start at middle C thus the first value is 60
 
   for(int i = 1;  i < totalNotes; i++)
-    midiValues[i] = midiValues[i - 1] + scale[(i - 1) % size];
+    values[i] = values[i - 1] + steps[(i - 1) % size];
+}
+
+void playMidiValues()
+{
+  for(int i = 0;  i < 17; i++)
+  {
+    USBMIDI.sendNoteOn(midiValues[i] +  key + octave * 12, 0, 1); 
+    delay(60);  
+    USBMIDI.sendNoteOff(midiValues[i] +  key + octave * 12, 0, 1); 
+    delay(60);
+  }
+}
+
+void changeKey(int value)
+{
+  key = value; 
+}
+
+void changeOctave(int value)
+{
+  octave = value - 64; 
+}
+
+void changeMidiChannel(int value)
+{
+  midiChannel = value; 
+}
+
+// A preset is everything that is usually changed between songs. Recalling one is a single option5 tap
+// (or the Next Preset gesture), program change 0 - 3 or CC 85 with the preset number. The note table for
+// every preset is built when the presets are loaded or stored so a recall is a copy. It is applied by
+// loop() between scans and only once all notes are off so no note off goes out with a different note.
+#define PRESETS 4
+#define PRESET_CC 85 // undefined in the MIDI spec
+
+struct Preset
+{
+  uint8_t scaleIndex;
+  int8_t key;
+  int8_t octave;
+  uint8_t midiChannel;
+  uint8_t masterVolume;
+  uint8_t adjacentPinsFilter;
+  uint8_t dissonantNotesFilter;
+  uint8_t modwheelCc; // the CC of the roll route
+  uint8_t playChords;
+} __attribute__((packed));
+
+Preset presets[PRESETS];
+uint8_t presetMidiValues[PRESETS][totalNotes];
+
+uint8_t currentPreset = 0;
+volatile int8_t pendingPreset = -1; // set by requestPreset() from any task
+
+bool presetValid(const Preset &preset)
+{
+  return preset.scaleIndex < scaleCount && preset.key >= 0 && preset.key <= 11 && preset.octave >= -5 &&
+    preset.octave <= 5 && preset.midiChannel >= 1 && preset.midiChannel <= 16 && preset.masterVolume <= 127 &&
+    preset.modwheelCc >= 1 && preset.modwheelCc <= 127;
+}
+
+void presetFromCurrent(Preset &preset)
+{
+  preset.scaleIndex = scaleIndex;
+  preset.key = key;
+  preset.octave = octave;
+  preset.midiChannel = midiChannel;
+  preset.masterVolume = masterVolume;
+  preset.adjacentPinsFilter = adjacentPinsFilter;
+  preset.dissonantNotesFilter = dissonantNotesFilter;
+  preset.modwheelCc = routes[ROUTE_ROLL].param;
+  preset.playChords = playChords;
+}
+
+void buildPresetTables()
+{
+  for(int i = 0; i < PRESETS; i++)
+    scaleToMidiValues(presetMidiValues[i], presets[i].scaleIndex);
+}
+
+// All the presets start as the default settings
+void initPresets()
+{
+  for(int i = 0; i < PRESETS; i++)
+    presetFromCurrent(presets[i]);
+}
+
+void requestPreset(uint8_t number)
+{
+  if(number < PRESETS)
+    pendingPreset = number;
+}
+
+// From loop() before the pins are read
+void applyPendingPreset()
+{
+  if(pendingPreset < 0 || !allNotesOff())
+    return;
+
+  currentPreset = pendingPreset;
+  pendingPreset = -1;
+
+  const Preset &preset = presets[currentPreset];
+
+  memcpy(midiValues, presetMidiValues[currentPreset], sizeof(midiValues));
+  scaleIndex = preset.scaleIndex;
+  key = preset.key;
+  octave = preset.octave;
+  midiChannel = preset.midiChannel;
+  masterVolume = preset.masterVolume;
+  adjacentPinsFilter = preset.adjacentPinsFilter;
+  dissonantNotesFilter = preset.dissonantNotesFilter;
+  playChords = preset.playChords;
+
+  if(routes[ROUTE_ROLL].param != preset.modwheelCc)
+  {
+    routes[ROUTE_ROLL].param = preset.modwheelCc;
+    compileRoutes();
+  }
+
+  char msg[24];
+
+  displayRefresh(); // so the screen the pop-up goes back to has the new settings
+  snprintf(msg, sizeof(msg), "  Preset %d", currentPreset + 1);
+  displayMessage(msg);
+}
+
+// Held option5, the settings now go in the preset that was last recalled
+void storePreset()
+{
+  presetFromCurrent(presets[currentPreset]);
+  scaleToMidiValues(presetMidiValues[currentPreset], scaleIndex);
+  saveConfig();
+
+  char msg[24];
+
+  displayRefresh();
+  snprintf(msg, sizeof(msg), " Preset %d saved", currentPreset + 1);
+  displayMessage(msg);
+}
+
+// A raw MIDI packet starts with RAW_MIDI_PACKET (an undefined MIDI status byte so it can't be mistaken
+// for the first byte of a note or CC packet). The second byte is the number of MIDI bytes that follow and
+// running status may be used. The other packets are told apart by their length so raw packets are padded
+// with zeros after the MIDI bytes to keep them off those lengths.
+#define RAW_MIDI_PACKET 0xF4
+
+// 3 is a CC, 4, 8 and 12 are notes and 9 is a pitch bend
+bool legacyPacketLength(int len)
+{
+  return len == 3 || len == 4 || len == 8 || len == 9 || len == 12;
+}
+
+// The packet needs room for 2 more bytes. Returns the padded length.
+int rawMidiPad(uint8_t *packet, int len)
+{
+  while(legacyPacketLength(len))
+    packet[len++] = 0;
+
+  return len;
+}
+
+// Number of data bytes that follow a MIDI channel message status byte
+uint8_t midiDataBytes(uint8_t status)
+{
+  uint8_t type = status & 0xF0;
+
+  if(type == 0xC0 || type == 0xD0) // program change and channel pressure
+    return 1;
+  else
+    return 2;
+}
+
+int wirelessSend(uint8_t *incomingData, int len)
+{
+  if(useBluetooth)
+  {
+    // The first type of packet is 4, 8 or 12 bytes for notes and chords. The first is the MIDI note value, the second is a flag 
+    // for note on or off, the third is the volume and the fourth is the MIDI channel.
+    // If it is a 9 byte packet (for a double) it is a pitch bend with the 9th byte being MIDI channel.
+    // A 3 byte packet is for CCs with the first being the CC number, the second the value
+    // and the third the MIDI channel
+    // Any other packet starting with RAW_MIDI_PACKET holds raw MIDI messages (see above).
+
+    if(bluetoothConnected)
+    {
+      if(!legacyPacketLength(len) && incomingData[0] == RAW_MIDI_PACKET) // Raw MIDI
+      {
+        int end = 2 + incomingData[1];
+        uint8_t status = 0;
+
+        if(end > len)
+          end = len;
+
+        for(int i = 2; i < end;)
+        {
+          if(incomingData[i] & 0x80)
+            status = incomingData[i++];
+
+          uint8_t n = midiDataBytes(status);
+
+          if(status == 0 || i + n > end)
+            break;
+
+          MIDI.send((midi::MidiType)(status & 0xF0), incomingData[i], n > 1 ? incomingData[i + 1] : 0, (status & 0x0F) + 1);
+          i += n;
+        }
+      }
+      else if(len == 4 || len == 8 || len == 12) // Notes
+      {
+        if(incomingData[1]) // first note
+        {
+          MIDI.sendNoteOn(incomingData[0], incomingData[2], incomingData[3]);
+        }
+        else
+        {
+          MIDI.sendNoteOff(incomingData[0], incomingData[2], incomingData[3]);
+        }
+        
+        if(len == 8 || len == 12) // second note if any
+        {
+          if(incomingData[5])
+          {
+            MIDI.sendNoteOn(incomingData[4], incomingData[6], incomingData[7]);
+          }
+          else
+          {
+            MIDI.sendNoteOff(incomingData[4], incomingData[6], incomingData[7]);
+          }
+        }
+        
+        if(len == 12) // third note if any
+        {
+          if(incomingData[9])
+          {
+            MIDI.sendNoteOn(incomingData[8], incomingData[10], incomingData[11]);
+          }
+          else
+          {
+            MIDI.sendNoteOff(incomingData[8], incomingData[10], incomingData[11]);
+          }
+        }
+      }
+      else if(len == 9) // Pitch bend
+      {
+        double bendData;
+        uint8_t *dp = (uint8_t *)&bendData;
+        for(int i = 0; i < 8; i++)
+        {
+          dp[i] = incomingData[i];
+        }
+
+        MIDI.sendPitchBend(bendData, incomingData[8]);
+      }
+      else if(len == 3) // CC
+      {
+        MIDI.sendControlChange(incomingData[0], incomingData[1], incomingData[2]);
+      }
+    }
+
+    return 0;
+  }
+  else
+  {
+    // Use esp_now...
+    return esp_now_send(0, incomingData, len);
+  }
+}
+
+// Channel messages that don't fit the note, pitch bend and CC packets are queued with
+// midiMessageAdd() and go out together as one raw MIDI packet when midiMessageFlush() is called.
+// With USB MIDI they are sent right away.
+uint8_t rawMidiPacket[64] = {RAW_MIDI_PACKET, 0};
+uint8_t rawMidiLength = 2;
+uint8_t rawMidiRunningStatus = 0;
+
+void midiMessageFlush()
+{
+  if(rawMidiLength > 2)
+  {
+    rawMidiPacket[1] = rawMidiLength - 2;
+
+    rawMidiLength = rawMidiPad(rawMidiPacket, rawMidiLength);
+
+    espNowMicrosAtSend = micros();
+    wirelessSend(rawMidiPacket, rawMidiLength);
+  }
+
+  rawMidiLength = 2;
+  rawMidiRunningStatus = 0;
+}
+
+void midiMessageAdd(uint8_t status, uint8_t data1, uint8_t data2)
+{
+  if(midiOn)
+  {
+    USBMIDI.send((midi::MidiType)(status & 0xF0), data1, data2, (status & 0x0F) + 1);
+    return;
+  }
+
+  if(rawMidiLength + 3 > (int)sizeof(rawMidiPacket))
+    midiMessageFlush();
+
+  if(status != rawMidiRunningStatus)
+  {
+    rawMidiPacket[rawMidiLength++] = status;
+    rawMidiRunningStatus = status;
+  }
+
+  rawMidiPacket[rawMidiLength++] = data1;
+
+  if(midiDataBytes(status) > 1)
+    rawMidiPacket[rawMidiLength++] = data2;
+}
+
+// Pitch bend from -1 to 1. The controller routes decide when to send it (see processRoutes()).
+void pitchBend(double bendX)
+{
+  if(midiOn)
+  {
+    USBMIDI.sendPitchBend(bendX, midiChannel);
+  }
+  else
+  {
+    uint8_t *p =  (uint8_t *)&bendX; 
+    uint8_t msgPitchbend[9];
+
+    for(int i = 0; i < 8; i++)
+    {
+      msgPitchbend[i] = p[i];
+    }
+
+    msgPitchbend[8] = midiChannel;  // MIDI channel
+
+    espNowMicrosAtSend = micros();
+    esp_err_t outcome = wirelessSend((uint8_t *) &msgPitchbend, sizeof(msgPitchbend));  
+  }
+}
+
+void controlChange(uint8_t cc, uint8_t value)
+{
+  if(midiOn)
+  {
+    USBMIDI.sendControlChange(cc, value, midiChannel); // CC, must be 0 - 127
+  }
+  else
+  {
+    uint8_t msgControl[3];
+
+    msgControl[0] = cc;
+    msgControl[1] = value;
+    msgControl[2] = midiChannel;  // MIDI channel
+
+    espNowMicrosAtSend = micros();
+    esp_err_t outcome = wirelessSend((uint8_t *) &msgControl, sizeof(msgControl));  
+  }
+}
+
+// 14 bit CC for CCs 0 - 31, the LSB goes on cc + 32. Only what has changed since the last time for this
+// route is sent and both are queued to go out together. A receiver takes a new MSB as having an LSB of 0
+// so the LSB is sent after a new MSB unless it is 0.
+void controlChange14(CompiledRoute &route, uint16_t value)
+{
+  uint8_t status = 0xB0 | ((midiChannel - 1) & 0x0F);
+  uint8_t msb = (value >> 7) & 0x7F;
+  uint8_t lsb = value & 0x7F;
+
+  if(msb != route.msb)
+  {
+    midiMessageAdd(status, route.param, msb);
+    route.msb = msb;
+    route.lsb = 0;
+  }
+
+  if(lsb != route.lsb)
+  {
+    midiMessageAdd(status, route.param + 32, lsb);
+    route.lsb = lsb;
+  }
+}
+
+void setVolume(uint8_t data1)
+{
+  masterVolume = data1;
+}
+
+// Incoming change requests (from USB MIDI, BLE MIDI or the hub) go through a table with a handler for
+// each CC number (0 - 127) and each status (0x80 - 0xFF). As always only channel 1 is listened to. A handler
+// returns true if what the display shows has changed so the display is only refreshed once for a whole batch.
+//
+//   CC 68 scale (1 - number of scales), CC 69 play the scale, CC 70 key (0 - 11), CC 71 octave (64 is 0),
+//   CC 72 MIDI channel, CC 85 and program change recall a preset
+//
+// The scale, key and octave can also be set with NRPN 68, 70 and 71 (CC 99 0, CC 98 68, 70 or 71) and
+// a 14 bit data entry (CC 6 MSB then CC 38 LSB). The octave is then 8192 for 0.
+typedef bool (*ChangeHandler)(uint8_t data1, uint8_t data2);
+
+ChangeHandler changeHandlers[256];
+
+uint16_t nrpnParameter = 0x3FFF; // none
+uint8_t dataEntryMsb = 0;
+
+bool setScale(uint16_t value)
+{
+  if(value < 1 || value > scaleCount)
+    return false;
+
+  scaleIndex = value - 1;
+  scaleToMidiValues(midiValues, scaleIndex);
+
+  return true;
+}
+
+bool changeScaleRequest(uint8_t data1, uint8_t data2)
+{
+  return setScale(data2);
+}
+
+bool playScaleRequest(uint8_t data1, uint8_t data2)
+{
+  playMidiValues();
+
+  return false;
+}
+
+bool changeKeyRequest(uint8_t data1, uint8_t data2)
+{
+  changeKey(data2);
+
+  return true;
+}
+
+bool changeOctaveRequest(uint8_t data1, uint8_t data2)
+{
+  changeOctave(data2);
+
+  return true;
+}
+
+bool changeChannelRequest(uint8_t data1, uint8_t data2)
+{
+  changeMidiChannel(data2);
+
+  return false;
+}
+
+// The preset shows a message when it is applied
+bool presetRequest(uint8_t data1, uint8_t data2)
+{
+  requestPreset(data2);
+
+  return false;
+}
+
+bool programChangeRequest(uint8_t data1, uint8_t data2)
+{
+  requestPreset(data1);
+
+  return false;
+}
+
+bool nrpnMsbRequest(uint8_t data1, uint8_t data2)
+{
+  nrpnParameter = (nrpnParameter & 0x7F) | (data2 << 7);
+
+  return false;
+}
+
+bool nrpnLsbRequest(uint8_t data1, uint8_t data2)
+{
+  nrpnParameter = (nrpnParameter & 0x3F80) | data2;
+
+  return false;
+}
+
+// An RPN is being selected so data entry isn't for us
+bool rpnRequest(uint8_t data1, uint8_t data2)
+{
+  nrpnParameter = 0x3FFF;
+
+  return false;
+}
+
+bool nrpnValue(uint16_t value)
+{
+  switch(nrpnParameter)
+  {
+    case 68:
+      return setScale(value);
+
+    case 70:
+      if(value > 11)
+        return false;
+
+      changeKey(value);
+      return true;
+
+    case 71:
+      if(value < 8192 - 5 || value > 8192 + 5)
+        return false;
+
+      changeOctave(value - 8192 + 64);
+      return true;
+  }
+
+  return false;
+}
+
+// A sender may only send the MSB. That is enough for the octave (the LSB is 0 for octave 0) so it is
+// used then and again when the LSB comes. The scale and key are all in the LSB so they wait for it.
+bool dataEntryMsbRequest(uint8_t data1, uint8_t data2)
+{
+  dataEntryMsb = data2;
+
+  if(nrpnParameter != 71)
+    return false;
+
+  return nrpnValue(data2 << 7);
+}
+
+bool dataEntryLsbRequest(uint8_t data1, uint8_t data2)
+{
+  return nrpnValue((dataEntryMsb << 7) | data2);
+}
+
+void setupChangeHandlers()
+{
+  changeHandlers[68] = changeScaleRequest;
+  changeHandlers[69] = playScaleRequest;
+  changeHandlers[70] = changeKeyRequest;
+  changeHandlers[71] = changeOctaveRequest;
+  changeHandlers[72] = changeChannelRequest;
+  changeHandlers[PRESET_CC] = presetRequest;
+  changeHandlers[99] = nrpnMsbRequest;
+  changeHandlers[98] = nrpnLsbRequest;
+  changeHandlers[101] = rpnRequest;
+  changeHandlers[100] = rpnRequest;
+  changeHandlers[6] = dataEntryMsbRequest;
+  changeHandlers[38] = dataEntryLsbRequest;
+  changeHandlers[0xC0] = programChangeRequest;
+}
+
+bool handleChangeRequest(uint8_t type, uint8_t data1, uint8_t data2)
+{
+  if(type < 0xF0 && (type & 0x0F)) // a channel message not on channel 1
+    return false;
+
+  ChangeHandler handler = changeHandlers[type == 0xB0 ? data1 & 0x7F : type];
+
+  return handler ? handler(data1, data2) : false;
+}
+
+// This is the callback for ESP-Now success/failure
+void data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) 
+{
+  uint32_t m = micros();
+  espNowReturnTime = m - espNowMicrosAtSend; // this is how many us it takes to get back the Esp-Now reply
+
+  portENTER_CRITICAL(&statsMux);
+
+  espNowSent++;
+
+  if(status)
+    espNowFailed++;
+  else
+    histogramAdd(espNowLatency, espNowReturnTime);
+
+  portEXIT_CRITICAL(&statsMux);
+
+  if(status) // did delivery fail?
+  {
+    // check to see if this is the rgb matrix
+    bool isRbgMatrix = true;
+    for(int i = 0; i < 6; i++)
+    {
+      if(mac_addr[i] != broadcastAddressRgbMatrix[i])
+        isRbgMatrix = false;
+    }
+
+    if(isRbgMatrix)
+    {
+      // remove the rgb matrix from the sender list
+      esp_now_del_peer(broadcastAddressRgbMatrix);
+    }
+    else
+    {
+      pixels.setPixelColor(0, 0xFF0000); // set LED to red
+      pixels.show(); 
+      espNowReturnTime = 0xFFFFFFFF; // to flag an error on the note display
+    }
+  }
+}
+
+volatile bool changeRequestRefresh = false; // a change request from the hub changed the display
+
+// SysEx bytes from the hub. data_received() only moves the head and loop() only moves the tail.
+uint8_t espNowSysex[256];
+volatile uint8_t espNowSysexHead = 0;
+volatile uint8_t espNowSysexTail = 0;
+
+void data_received(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+  if(binding) // are we waiting for the hub to bind?
+  {
+    // check if there is a valid id in the data
+    const uint8_t id[] = {'E', 'M', 'M', 'M', 'A', '-', 'K'};
+
+    if(data_len == sizeof(id) && !memcmp(id, data, data_len))
+    {
+      // initialize hub address, save config and reboot...
+      memcpy(broadcastAddressMidiHub, mac_addr, 6);
+
+      saveConfig();
+
+      restartAfterSave();
+
+      return;
+    }
+  }
+
+  if(data_len > 2 && data[0] == RAW_MIDI_PACKET) // SysEx from the hub, for loop() to parse
+  {
+    int end = 2 + data[1] < data_len ? 2 + data[1] : data_len;
+
+    for(int i = 2; i < end; i++)
+    {
+      uint8_t next = espNowSysexHead + 1;
+
+      if(next == espNowSysexTail)
+        break; // full, the message will fail its CRC or be cut short
+
+      espNowSysex[espNowSysexHead] = data[i];
+      espNowSysexHead = next;
+    }
+
+    return;
+  }
+
+  if(data_len >= 3 && handleChangeRequest(data[0], data[1], data[2]))
+    changeRequestRefresh = true; // loop() refreshes the display
+}
+
+// The config is kept in NVS as one binary record (see config_store.h). JSON is only used for the
+// config.json file from older firmware, which is brought over once, and to import and export the config
+// over serial (see processSerialConfig()).
+//
+// CONFIG_VERSION goes up when a field is added to StoredConfig (only ever on the end) or the meaning of
+// one changes, migrateConfig() fixes up a config saved by an older version.
+#define CONFIG_VERSION 1
+
+struct StoredConfig
+{
+  uint8_t useBluetooth;
+  uint8_t scaleIndex;
+  uint8_t midiChannel;
+  uint8_t masterVolume;
+  uint8_t adjacentPinsFilter;
+  uint8_t dissonantNotesFilter;
+  uint8_t highResCc;
+  uint8_t broadcastAddressMidiHub[6];
+  uint8_t pressureMode;
+  uint8_t touchProfile;
+  uint8_t crosstalkCompensation;
+  uint8_t imuMode;
+  uint8_t gestureActions[GESTURES];
+  uint8_t gestureParams[GESTURES];
+  uint8_t imuOffsetsSaved;
+  int16_t imuOffsets[6];
+  uint16_t onThresholds[numPins];
+  uint16_t offThresholds[numPins];
+  int16_t crosstalkLeft[notePins];
+  int16_t crosstalkRight[notePins];
+  uint8_t routeCount;
+  Route routes[MAX_ROUTES];
+  Preset presets[PRESETS];
+} __attribute__((packed));
+
+#define CONFIG_RECORD_SIZE (sizeof(ConfigHeader) + sizeof(StoredConfig))
+
+const char *config_filename = "/config.json";
+
+// With up to MAX_ROUTES nested arrays this is too big for the loop task's stack so it's on the heap
+#define CONFIG_JSON_SIZE 4096
+
+void configToStored(StoredConfig &c)
+{
+  memset(&c, 0, sizeof(c));
+
+  c.useBluetooth = useBluetooth;
+  c.scaleIndex = scaleIndex;
+  c.midiChannel = midiChannel;
+  c.masterVolume = masterVolume;
+  c.adjacentPinsFilter = adjacentPinsFilter;
+  c.dissonantNotesFilter = dissonantNotesFilter;
+  c.highResCc = highResCc;
+  memcpy(c.broadcastAddressMidiHub, broadcastAddressMidiHub, 6);
+  c.pressureMode = pressureMode;
+  c.touchProfile = touchProfile;
+  c.crosstalkCompensation = crosstalkCompensation;
+  c.imuMode = imuMode;
+  memcpy(c.gestureActions, gestureActions, sizeof(c.gestureActions));
+  memcpy(c.gestureParams, gestureParams, sizeof(c.gestureParams));
+  c.imuOffsetsSaved = imuOffsetsSaved;
+  memcpy(c.imuOffsets, imuOffsets, sizeof(c.imuOffsets));
+  memcpy(c.onThresholds, onThresholds, sizeof(c.onThresholds));
+  memcpy(c.offThresholds, offThresholds, sizeof(c.offThresholds));
+  memcpy(c.crosstalkLeft, crosstalk.left, sizeof(c.crosstalkLeft));
+  memcpy(c.crosstalkRight, crosstalk.right, sizeof(c.crosstalkRight));
+  c.routeCount = routeCount;
+  memcpy(c.routes, routes, sizeof(c.routes));
+  memcpy(c.presets, presets, sizeof(c.presets));
 }
 
-void playMidiValues()
-{
-  for(int i = 0;  i < 17; i++)
+// Anything out of range keeps what it was
+void configFromStored(const StoredConfig &c)
+{
+  useBluetooth = c.useBluetooth;
+
+  if(c.scaleIndex < scaleCount)
+    scaleIndex = c.scaleIndex;
+
+  if(c.midiChannel >= 1 && c.midiChannel <= 16)
+    midiChannel = c.midiChannel;
+
+  if(c.masterVolume <= 127)
+    masterVolume = c.masterVolume;
+
+  adjacentPinsFilter = c.adjacentPinsFilter;
+  dissonantNotesFilter = c.dissonantNotesFilter;
+  highResCc = c.highResCc;
+  memcpy(broadcastAddressMidiHub, c.broadcastAddressMidiHub, 6);
+
+  if(c.pressureMode <= 2)
+    pressureMode = c.pressureMode;
+
+  if(c.touchProfile < touchProfileCount)
+    touchProfile = c.touchProfile;
+
+  crosstalkCompensation = c.crosstalkCompensation;
+  imuMode = c.imuMode == IMU_FUSION ? IMU_FUSION : IMU_DMP;
+
+  for(int i = 0; i < GESTURES; i++)
   {
-    USBMIDI.sendNoteOn(midiValues[i] +  key + octave * 12, 0, 1); 
-    delay(60);  
-    USBMIDI.sendNoteOff(midiValues[i] +  key + octave * 12, 0, 1); 
-    delay(60);
+    if(c.gestureActions[i] < GESTURE_ACTIONS)
+      gestureActions[i] = c.gestureActions[i];
+
+    gestureParams[i] = c.gestureParams[i] & 0x7F;
+  }
+
+  imuOffsetsSaved = c.imuOffsetsSaved;
+  memcpy(imuOffsets, c.imuOffsets, sizeof(imuOffsets));
+  memcpy(onThresholds, c.onThresholds, sizeof(onThresholds));
+  memcpy(offThresholds, c.offThresholds, sizeof(offThresholds));
+  memcpy(crosstalk.left, c.crosstalkLeft, sizeof(c.crosstalkLeft));
+  memcpy(crosstalk.right, c.crosstalkRight, sizeof(c.crosstalkRight));
+
+  // the first three have to be from pitch, roll and yaw for the menu
+  if(c.routeCount > ROUTE_YAW && c.routeCount <= MAX_ROUTES)
+  {
+    uint8_t count = 0;
+
+    for(int i = 0; i < c.routeCount; i++)
+    {
+      if(routeValid(c.routes[i]) && (count > ROUTE_YAW || c.routes[i].source == routes[count].source))
+        routes[count++] = c.routes[i];
+    }
+
+    if(count > ROUTE_YAW)
+      routeCount = count;
+  }
+
+  for(int i = 0; i < PRESETS; i++)
+  {
+    if(presetValid(c.presets[i]))
+      presets[i] = c.presets[i];
   }
 }
 
-void changeKey(int value)
+// For when a field is added or changed, there is nothing to do yet
+void migrateConfig(StoredConfig &c, uint16_t version)
 {
-  key = value; 
 }
 
-void changeOctave(int value)
+// Saves are written by configTask() on core 0 so the flash write (tens of ms when NVS has to erase a
+// page) never holds up the touch scan or, from data_received(), the WiFi task. saveConfig() only takes
+// a copy of the config. If there are more saves before the task gets to it only the last is written.
+TaskHandle_t configTaskHandle = NULL;
+
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+StoredConfig configPending;
+uint32_t configRequests = 0;               // saves asked for
+volatile uint32_t configSavedRequests = 0; // saves written (or given up on)
+
+uint32_t configSequence = 0; // of the newest slot, only changed by readConfig() and then the task
+
+volatile bool restartRequested = false; // set from the WiFi task when binding
+
+const char *configSlotKeys[CONFIG_SLOTS] = {"configA", "configB"};
+
+void saveConfig() 
 {
-  octave = value - 64; 
+  StoredConfig c;
+
+  configToStored(c);
+
+  portENTER_CRITICAL(&configMux);
+  memcpy(&configPending, &c, sizeof(c));
+  configRequests++;
+  portEXIT_CRITICAL(&configMux);
+
+  xTaskNotifyGive(configTaskHandle);
 }
 
-void changeMidiChannel(int value)
+bool configSaved()
 {
-  midiChannel = value; 
+  portENTER_CRITICAL(&configMux);
+  bool saved = configSavedRequests == configRequests;
+  portEXIT_CRITICAL(&configMux);
+
+  return saved;
 }
 
-int wirelessSend(uint8_t *incomingData, int len)
+// Restarts from loop(), or the binding wait in setup(), once any save has been written
+void restartAfterSave()
 {
-  if(useBluetooth)
+  restartRequested = true;
+}
+
+void configTask(void *parameter)
+{
+  static StoredConfig c;
+  static uint8_t record[CONFIG_RECORD_SIZE];
+
+  for(;;)
   {
-    // The first type of packet is 4, 8 or 12 bytes for notes and chords. The first is the MIDI note value, the second is a flag 
-    // for note on or off, the third is the volume and the fourth is the MIDI channel.
-    // If it is a 9 byte packet (for a double) it is a pitch bend with the 9th byte being MIDI channel.
-    // A 3 byte packet is for CCs with the first being the CC number, the second the value
-    // and the third the MIDI channel
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    if(bluetoothConnected)
-    {
-      if(len == 4 || len == 8 || len == 12) // Notes
-      {
-        if(incomingData[1]) // first note
-        {
-          MIDI.sendNoteOn(incomingData[0], incomingData[2], incomingData[3]);
-        }
-        else
-        {
-          MIDI.sendNoteOff(incomingData[0], incomingData[2], incomingData[3]);
-        }
-        
-        if(len == 8 || len == 12) // second note if any
-        {
-          if(incomingData[5])
-          {
-            MIDI.sendNoteOn(incomingData[4], incomingData[6], incomingData[7]);
-          }
-          else
-          {
-            MIDI.sendNoteOff(incomingData[4], incomingData[6], incomingData[7]);
-          }
-        }
-        
-        if(len == 12) // third note if any
-        {
-          if(incomingData[9])
-          {
-            MIDI.sendNoteOn(incomingData[8], incomingData[10], incomingData[11]);
-          }
-          else
-          {
-            MIDI.sendNoteOff(incomingData[8], incomingData[10], incomingData[11]);
-          }
-        }
-      }
-      else if(len == 9) // Pitch bend
-      {
-        double bendData;
-        uint8_t *dp = (uint8_t *)&bendData;
-        for(int i = 0; i < 8; i++)
-        {
-          dp[i] = incomingData[i];
-        }
+    portENTER_CRITICAL(&configMux);
+    memcpy(&c, &configPending, sizeof(c));
+    uint32_t request = configRequests;
+    portEXIT_CRITICAL(&configMux);
 
-        MIDI.sendPitchBend(bendData, incomingData[8]);
-      }
-      else if(len == 3) // CC
-      {
-        MIDI.sendControlChange(incomingData[0], incomingData[1], incomingData[2]);
-      }
+    if(request == configSavedRequests)
+      continue;
+
+    uint32_t start = micros();
+    uint32_t sequence = configSequence + 1;
+    int slot = configSlot(sequence);
+
+    size_t length = configPack(record, &c, sizeof(c), CONFIG_VERSION, sequence);
+
+    Preferences preferences;
+
+    preferences.begin("emmma-k", false);
+
+    if(preferences.putBytes(configSlotKeys[slot], record, length) == length)
+    {
+      configSequence = sequence;
+      Serial.printf("Config %u saved in slot %c in %uus\n", sequence, 'A' + slot, micros() - start);
+    }
+    else
+    {
+      Serial.println("Config save failed"); // the other slot still has the last one
     }
 
-    return 0;
-  }
-  else
-  {
-    // Use esp_now...
-    return esp_now_send(0, incomingData, len);
+    preferences.end();
+
+    portENTER_CRITICAL(&configMux);
+    configSavedRequests = request;
+    portEXIT_CRITICAL(&configMux);
   }
 }
 
-void pitchBend(double bendX)
+void startConfigTask()
 {
-  static bool bendActive = false;
+  xTaskCreatePinnedToCore(configTask, "Config", 4096, NULL, 1, &configTaskHandle, 0);
+}
 
-  if(midiOn)
+void configToJson(JsonDocument &doc)
+{
+  doc["version"] = CONFIG_VERSION;
+  doc["useBluetooth"] = useBluetooth;
+  doc["scaleIndex"] = scaleIndex;
+  doc["midiChannel"] = midiChannel;
+  doc["masterVolume"] = masterVolume;
+  doc["adjacentPinsFilter"] = adjacentPinsFilter;
+  doc["dissonantNotesFilter"] = dissonantNotesFilter;
+  doc["highResCc"] = highResCc;
+  char hub[7] = {0}; // a 6 character string as it always has been
+
+  memcpy(hub, broadcastAddressMidiHub, 6);
+  doc["broadcastAddressMidiHub"] = hub;
+  doc["pressureMode"] = pressureMode;
+  doc["touchProfile"] = touchProfile;
+  doc["crosstalkCompensation"] = crosstalkCompensation;
+  doc["imuMode"] = imuMode;
+
+  JsonArray _gestureActions = doc.createNestedArray("gestureActions");
+  JsonArray _gestureParams = doc.createNestedArray("gestureParams");
+
+  for(int i = 0; i < GESTURES; i++)
   {
-    if(option1)
-    {
-      USBMIDI.sendPitchBend(bendX, midiChannel);
+    _gestureActions.add(gestureActions[i]);
+    _gestureParams.add(gestureParams[i]);
+  }
 
-      bendActive = true;
-    }
-    else if(bendActive)
-    {
-      // Send pitchbend of 0 once when option1 removed
-      USBMIDI.sendPitchBend(0.0, midiChannel);
+  if(imuOffsetsSaved)
+  {
+    JsonArray _imuOffsets = doc.createNestedArray("imuOffsets");
 
-      bendActive = false;
-    }
+    for(int i = 0; i < 6; i++)
+      _imuOffsets.add(imuOffsets[i]);
   }
-  else
+
+  JsonArray _onThresholds = doc.createNestedArray("onThresholds");
+  JsonArray _offThresholds = doc.createNestedArray("offThresholds");
+
+  for(int i = 0; i < numPins; i++)
   {
-    if(option1)
-    {
-      uint8_t *p =  (uint8_t *)&bendX; 
-      uint8_t msgPitchbend[9];
+    _onThresholds.add(onThresholds[i]);
+    _offThresholds.add(offThresholds[i]);
+  }
 
-      for(int i = 0; i < 8; i++)
-      {
-        msgPitchbend[i] = p[i];
-      }
+  JsonArray _crosstalkLeft = doc.createNestedArray("crosstalkLeft");
+  JsonArray _crosstalkRight = doc.createNestedArray("crosstalkRight");
 
-      msgPitchbend[8] = midiChannel;  // MIDI channel
+  for(int i = 0; i < notePins; i++)
+  {
+    _crosstalkLeft.add(crosstalk.left[i]);
+    _crosstalkRight.add(crosstalk.right[i]);
+  }
 
-      espNowMicrosAtSend = micros();
-      esp_err_t outcome = wirelessSend((uint8_t *) &msgPitchbend, sizeof(msgPitchbend));  
-      bendActive = true;
-    }
-    else if(bendActive)
-    {
-      // Send pitchbend of 0 once when option1 removed
-      double zero = 0.0;
-      uint8_t *p =  (uint8_t *)&zero; 
-      uint8_t msgPitchbend[9];
+  // routes are saved as [source, destination, param, flags, curve, amount, range, dead zone, invert]
+  JsonArray _routes = doc.createNestedArray("routes");
 
-      for(int i = 0; i < 8; i++)
-        msgPitchbend[i] = p[i];
-        
-      msgPitchbend[8] = midiChannel;  // MIDI channel
+  for(int i = 0; i < routeCount; i++)
+  {
+    JsonArray route = _routes.createNestedArray();
+
+    route.add(routes[i].source);
+    route.add(routes[i].destination);
+    route.add(routes[i].param);
+    route.add(routes[i].flags);
+    route.add(routes[i].axis.curve);
+    route.add(routes[i].axis.amount);
+    route.add(routes[i].axis.range);
+    route.add(routes[i].axis.deadZone);
+    route.add(routes[i].axis.invert);
+  }
 
-      esp_err_t outcome = wirelessSend((uint8_t *) &msgPitchbend, sizeof(msgPitchbend));  
-      bendActive = false;
-    }
+  // presets are [scale, key, octave, channel, volume, adjacent filter, dissonant filter, modwheel CC, chords]
+  JsonArray _presets = doc.createNestedArray("presets");
+
+  for(int i = 0; i < PRESETS; i++)
+  {
+    JsonArray preset = _presets.createNestedArray();
+
+    preset.add(presets[i].scaleIndex);
+    preset.add(presets[i].key);
+    preset.add(presets[i].octave);
+    preset.add(presets[i].midiChannel);
+    preset.add(presets[i].masterVolume);
+    preset.add(presets[i].adjacentPinsFilter);
+    preset.add(presets[i].dissonantNotesFilter);
+    preset.add(presets[i].modwheelCc);
+    preset.add(presets[i].playChords);
   }
 }
 
-void modwheel(uint8_t modX)
+// Config files from before the routes only had ccForModwheel, the rest keep the defaults
+void readOldControllerSettings(JsonDocument &doc)
 {
-  static bool modActive = false;
+  const int _ccForModwheel = doc["ccForModwheel"] | 0;
 
-  if(midiOn)
+  if(_ccForModwheel >= 1 && _ccForModwheel <= 127)
+    routes[ROUTE_ROLL].param = _ccForModwheel;
+}
+
+// Keys that are missing keep what they are
+void configFromJson(JsonDocument &doc)
+{
+  const bool _useBluetooth = doc["useBluetooth"] | useBluetooth;
+  const int _scaleIndex = doc["scaleIndex"] | scaleIndex;
+  const int _midiChannel = doc["midiChannel"] | (int)midiChannel;
+  const int _masterVolume = doc["masterVolume"] | masterVolume;
+  const int _adjacentPinsFilter = doc["adjacentPinsFilter"] | (int)adjacentPinsFilter;
+  const int _dissonantNotesFilter = doc["dissonantNotesFilter"] | (int)dissonantNotesFilter;
+  const bool _highResCc = doc["highResCc"] | highResCc;
+  const char *_broadcastAddressMidiHub = doc["broadcastAddressMidiHub"] | "";
+  const int _pressureMode = doc["pressureMode"] | (int)pressureMode;
+  const int _touchProfile = doc["touchProfile"] | (int)touchProfile;
+  const bool _crosstalkCompensation = doc["crosstalkCompensation"] | crosstalkCompensation;
+  const int _imuMode = doc["imuMode"] | (int)imuMode;
+
+  // the same checks as configFromStored(), anything out of range keeps what it is
+  useBluetooth = _useBluetooth;
+
+  if(_scaleIndex >= 0 && _scaleIndex < scaleCount)
+    scaleIndex = _scaleIndex;
+
+  if(_midiChannel >= 1 && _midiChannel <= 16)
+    midiChannel = _midiChannel;
+
+  if(_masterVolume >= 0 && _masterVolume <= 127)
+    masterVolume = _masterVolume;
+
+  adjacentPinsFilter = _adjacentPinsFilter;
+  dissonantNotesFilter = _dissonantNotesFilter;
+  highResCc = _highResCc;
+  if(strlen(_broadcastAddressMidiHub) == 6)
+    memcpy(broadcastAddressMidiHub, _broadcastAddressMidiHub, 6);
+
+  if(_pressureMode >= 0 && _pressureMode <= 2)
+    pressureMode = _pressureMode;
+
+  if(_touchProfile >= 0 && _touchProfile < touchProfileCount)
+    touchProfile = _touchProfile;
+
+  for(int i = 0; i < numPins; i++)
   {
-    if(option1)
-    {
-      if(modX >= 0)
-      {
-        USBMIDI.sendControlChange(ccForModwheel, modX, midiChannel); // CC, must be 0 - 127
+    onThresholds[i] = doc["onThresholds"][i] | onThresholds[i];
+    offThresholds[i] = doc["offThresholds"][i] | offThresholds[i];
+  }
 
-        modActive = true;
-      }
-    }
-    else if(modActive)
-    {
-      // Send modwheel of 0 once when option4 removed
-      USBMIDI.sendControlChange(ccForModwheel, 0, midiChannel); 
+  crosstalkCompensation = _crosstalkCompensation;
 
-      modActive = false;
-    }
+  imuMode = _imuMode == IMU_FUSION ? IMU_FUSION : IMU_DMP;
+
+  for(int i = 0; i < GESTURES; i++)
+  {
+    const int _action = doc["gestureActions"][i] | (int)gestureActions[i];
+
+    if(_action >= 0 && _action < (int)GESTURE_ACTIONS)
+      gestureActions[i] = _action;
+
+    gestureParams[i] = (doc["gestureParams"][i] | gestureParams[i]) & 0x7F;
   }
-  else
+
+  JsonArray _imuOffsets = doc["imuOffsets"];
+
+  if(_imuOffsets.size() == 6)
   {
-    uint8_t msgModwheel[3];
+    for(int i = 0; i < 6; i++)
+      imuOffsets[i] = _imuOffsets[i];
 
-    if(option1)
-    {
-      uint8_t mod = modX;
+    imuOffsetsSaved = true;
+  }
+
+  for(int i = 0; i < notePins; i++)
+  {
+    crosstalk.left[i] = doc["crosstalkLeft"][i] | crosstalk.left[i];
+    crosstalk.right[i] = doc["crosstalkRight"][i] | crosstalk.right[i];
+  }
 
-      msgModwheel[0] = ccForModwheel;
-      msgModwheel[1] = mod;
-      msgModwheel[2] = midiChannel;  // MIDI channel
+  JsonArray _routes = doc["routes"];
 
-      espNowMicrosAtSend = micros();
-      esp_err_t outcome = wirelessSend((uint8_t *) &msgModwheel, sizeof(msgModwheel));  
-      modActive = true;
-    }
-    else if(modActive)
+  if(_routes.isNull())
+  {
+    // from before routes
+    readOldControllerSettings(doc);
+  }
+  else
+  {
+    routeCount = 0;
+
+    for(JsonArray _route : _routes)
     {
-      // Send modwheel of 0 once when option1 removed
-        
-      msgModwheel[0] = ccForModwheel;
+      Route route;
+
+      route.source = _route[0];
+      route.destination = _route[1];
+      route.param = _route[2];
+      route.flags = _route[3];
+      route.axis.curve = _route[4];
+      route.axis.amount = _route[5];
+      route.axis.range = _route[6];
+      route.axis.deadZone = _route[7];
+      route.axis.invert = _route[8];
+
+      // the first three have to be from pitch, roll and yaw for the menu
+      if(routeCount < MAX_ROUTES && _route.size() == 9 && routeValid(route) && 
+        (routeCount > ROUTE_YAW || route.source == routes[routeCount].source))
+      {
+        routes[routeCount++] = route;
+      }
+    }
 
-      msgModwheel[1] = 0;
+    if(routeCount <= ROUTE_YAW)
+      routeCount = ROUTE_YAW + 1; // keep the defaults for the rest of the first three
+  }
 
-      msgModwheel[2] = midiChannel;  // MIDI channel
+  JsonArray _presets = doc["presets"];
 
-      esp_err_t outcome = wirelessSend((uint8_t *) &msgModwheel, sizeof(msgModwheel));  
-      modActive = false;
-    }
+  for(int i = 0; i < PRESETS && i < (int)_presets.size(); i++)
+  {
+    JsonArray _preset = _presets[i];
+    Preset preset;
+
+    preset.scaleIndex = _preset[0];
+    preset.key = _preset[1];
+    preset.octave = _preset[2];
+    preset.midiChannel = _preset[3];
+    preset.masterVolume = _preset[4];
+    preset.adjacentPinsFilter = _preset[5];
+    preset.dissonantNotesFilter = _preset[6];
+    preset.modwheelCc = _preset[7];
+    preset.playChords = _preset[8];
+
+    if(_preset.size() == 9 && presetValid(preset))
+      presets[i] = preset;
   }
+
+  buildPresetTables();
 }
 
-void setVolume(uint8_t data1)
+// config.json from older firmware. It was only used if configInit was this.
+bool readConfigFile()
 {
-  masterVolume = data1;
+  File file = LittleFS.open(config_filename);
+
+  if(!file || file.size() == 0 || file.size() > CONFIG_JSON_SIZE)
+  {
+    if(file)
+      file.close();
+
+    return false;
+  }
+
+  DynamicJsonDocument doc(CONFIG_JSON_SIZE);
+
+  auto error = deserializeJson(doc, file);
+
+  file.close();
+
+  const char *_configInit = doc["configInit"] | "";
+
+  if(error || strcmp(_configInit, "3.14159265359"))
+    return false;
+
+  configFromJson(doc);
+
+  return true;
 }
 
-void handleChangeRequest(uint8_t type, uint8_t data1, uint8_t data2)
+bool readConfig() 
 {
-  if(type == 176 && data1 == 68) // is this control change #68?
+  uint32_t start = micros();
+
+  static uint8_t record[CONFIG_RECORD_SIZE + 64]; // room for a bigger one from newer firmware
+  size_t length = 0;
+  ConfigHeader newest;
+  int newestSlot = -1;
+
+  Preferences preferences;
+
+  preferences.begin("emmma-k", true);
+
+  // find the newest slot that has a whole record and read it again
+  for(int slot = 0; slot < CONFIG_SLOTS; slot++)
   {
-    // if so data2 contains the scale: 1 to number of scales 
-    scaleIndex = data2 - 1; // scaleIndex won't be set properly if called from external MIDI or ESP-Now...
+    ConfigHeader header;
+
+    length = preferences.getBytes(configSlotKeys[slot], record, sizeof(record));
 
-    switch(data2)
+    if(configCheck(record, length, header) && (newestSlot < 0 || configNewer(header.sequence, newest.sequence)))
     {
-      case 1:
-      scaleToMidiValues(majorscale, sizeof(majorscale));
-      break;
-        
-      case 2:
-      scaleToMidiValues(minorscale, sizeof(minorscale));
-      break;
-        
-      case 3:
-      scaleToMidiValues(pentascale, sizeof(pentascale));
-      break;
-        
-      case 4:
-      scaleToMidiValues(minorpentascale, sizeof(minorpentascale));
-      break;
-        
-      case 5:
-      scaleToMidiValues(majorbluesscale, sizeof(majorbluesscale));
-      break;        
+      newest = header;
+      newestSlot = slot;
+    }
+  }
+
+  if(newestSlot >= 0 && newestSlot != CONFIG_SLOTS - 1)
+    length = preferences.getBytes(configSlotKeys[newestSlot], record, sizeof(record));
+
+  preferences.end();
+
+  StoredConfig c;
+  uint16_t version;
+
+  configToStored(c); // the defaults for anything the record doesn't have
+
+  if(newestSlot >= 0 && configUnpack(record, length, &c, sizeof(c), version, configSequence))
+  {
+    if(version < CONFIG_VERSION)
+      migrateConfig(c, version);
+
+    configFromStored(c);
+
+    Serial.printf("Config %u version %u read from slot %c in %uus\n", configSequence, version, 'A' + newestSlot,
+      micros() - start);
+
+    if(version != CONFIG_VERSION)
+      saveConfig();
+
+    return true;
+  }
 
-      case 6:
-      scaleToMidiValues(minorbluesscale, sizeof(minorbluesscale));
-      break;        
+  if(readConfigFile())
+  {
+    Serial.printf("Config brought over from %s in %uus\n", config_filename, micros() - start);
+    saveConfig();
 
-      case 7:
-      scaleToMidiValues(minorharmonic, sizeof(minorharmonic));
-      break;        
+    return true;
+  }
 
-      case 8:
-      scaleToMidiValues(minormelodic, sizeof(minormelodic));
-      break;        
+  Serial.println("Initializing config with defaults...");
+  saveConfig();
 
-      case 9:
-      scaleToMidiValues(minorpo33, sizeof(minorpo33));
-      break;        
+  return false;
+}
 
-      case 10:
-      scaleToMidiValues(dorian, sizeof(dorian));
-      break;        
+// After the config has been replaced by an import over serial or SysEx
+void applyConfigChanges(uint8_t oldProfile)
+{
+  if(touchProfile != oldProfile)
+    applyTouchProfile(oldProfile);
+  else
+    updateTouchLevels();
 
-      case 11:
-      scaleToMidiValues(phrygian, sizeof(phrygian));
-      break;        
+  compileRoutes();
+  buildPresetTables();
+  handleChangeRequest(176, 68, scaleIndex + 1);
+  saveConfig();
+}
 
-      case 12:
-      scaleToMidiValues(lydian, sizeof(lydian));
-      break;        
+// Over serial, "export" prints the config as JSON on one line and a line of JSON (starting with '{') is
+// imported and saved. Some settings (wireless mode, IMU mode) only take effect after a restart.
+void processSerialConfig()
+{
+  static char line[CONFIG_JSON_SIZE / 2];
+  static size_t length = 0;
 
-      case 13:
-      scaleToMidiValues(mixolydian, sizeof(mixolydian));
-      break;        
+  while(Serial.available())
+  {
+    char c = Serial.read();
 
-      case 14:
-      scaleToMidiValues(aeolian, sizeof(aeolian));
-      break;        
+    if(c != '\n' && c != '\r')
+    {
+      if(length < sizeof(line) - 1)
+        line[length++] = c;
 
-      case 15:
-      scaleToMidiValues(locrian, sizeof(locrian));
-      break;        
+      continue;
+    }
 
-      case 16:
-      scaleToMidiValues(lydiandomiant, sizeof(lydiandomiant));
-      break;        
+    if(length == 0)
+      continue;
 
-      case 17:
-      scaleToMidiValues(superlocrian, sizeof(superlocrian));
-      break;        
+    line[length] = 0;
+    length = 0;
 
-      case 18:
-      scaleToMidiValues(wholehalfdiminished, sizeof(wholehalfdiminished));
-      break;        
+    if(!strcmp(line, "export"))
+    {
+      DynamicJsonDocument doc(CONFIG_JSON_SIZE);
 
-      case 19:
-      scaleToMidiValues(halfwholediminished, sizeof(halfwholediminished));
-      break;        
+      configToJson(doc);
+      serializeJson(doc, Serial);
+      Serial.println();
+    }
+    else if(line[0] == '{')
+    {
+      DynamicJsonDocument doc(CONFIG_JSON_SIZE);
 
-      case 20:
-      scaleToMidiValues(chromatic, sizeof(chromatic));
-     break;        
+      if(deserializeJson(doc, (const char *)line))
+      {
+        Serial.println("Config import failed");
+      }
+      else
+      {
+        uint8_t oldProfile = touchProfile;
 
-      default:
-        break;  
+        configFromJson(doc);
+        applyConfigChanges(oldProfile);
+        Serial.println("Config imported");
+      }
     }
   }
-  else if(type == 176 && data1 == 69) // is this control change #69?
-  {
-    playMidiValues(); // If so play the current scale
-  }
-  else if(type == 176 && data1 == 70) // is this control change #70?
+}
+
+// SysEx (see sysex_protocol.h) over USB MIDI, BLE MIDI or from the hub over ESP-Now, whichever is in use
+// so there is one parser. A config that is written is applied by loop() between scans once all notes
+// are off, the same as a preset. Wireless and IMU mode changes only take effect after a restart.
+enum SysexPort
+{
+  PORT_USB = 0,
+  PORT_BLE,
+  PORT_ESPNOW
+};
+
+uint8_t sysexBuffer[CONFIG_RECORD_SIZE + 64]; // room for a bigger record from newer firmware
+SysexParser sysexParser;
+
+StoredConfig sysexConfig;
+bool sysexConfigPending = false;
+
+void sysexSend(uint8_t port, const uint8_t *data, int length)
+{
+  if(port == PORT_USB)
   {
-    changeKey(data2); // If so change the key
+    USBMIDI.sendSysEx(length, data, true);
   }
-  else if(type == 176 && data1 == 71) // is this control change #71?
+  else if(port == PORT_BLE)
   {
-    changeOctave(data2); // If so play change the octave
+    MIDI.sendSysEx(length, data, true);
   }
-  else if(type == 176 && data1 == 72) // is this control change #7?
+  else
   {
-    changeMidiChannel(data2); // If so play change the midi channel
+    // as a raw MIDI packet, the hub passes the bytes on
+    uint8_t packet[2 + 64 + 2] = {RAW_MIDI_PACKET, (uint8_t)length};
+
+    memcpy(packet + 2, data, length);
+
+    esp_now_send(0, packet, rawMidiPad(packet, 2 + length));
   }
 }
 
-// This is the callback for ESP-Now success/failure
-void data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) 
+// Sent in pieces of up to 64 bytes so there is no buffer for the whole message
+void sysexReply(uint8_t port, uint8_t command, const uint8_t *data, int length)
 {
-  uint32_t m = micros();
-  espNowReturnTime = m - espNowMicrosAtSend; // this is how many us it takes to get back the Esp-Now reply
+  uint8_t chunk[64] = {0xF0, SYSEX_MANUFACTURER, SYSEX_DEVICE, command};
+  int n = 4;
 
-  if(status) // did delivery fail?
+  for(int i = 0; i < length; i += 49)
   {
-    // check to see if this is the rgb matrix
-    bool isRbgMatrix = true;
-    for(int i = 0; i < 6; i++)
+    if(n + 56 > (int)sizeof(chunk))
     {
-      if(mac_addr[i] != broadcastAddressRgbMatrix[i])
-        isRbgMatrix = false;
+      sysexSend(port, chunk, n);
+      n = 0;
     }
 
-    if(isRbgMatrix)
-    {
-      // remove the rgb matrix from the sender list
-      esp_now_del_peer(broadcastAddressRgbMatrix);
-    }
-    else
-    {
-      pixels.setPixelColor(0, 0xFF0000); // set LED to red
-      pixels.show(); 
-      espNowReturnTime = 0xFFFFFFFF; // to flag an error on the note display
-    }
+    n += sysexEncode(data + i, length - i < 49 ? length - i : 49, chunk + n);
   }
+
+  chunk[n++] = 0xF7;
+  sysexSend(port, chunk, n);
 }
 
-void data_received(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+void sysexStats(uint8_t port)
 {
-  if(binding) // are we waiting for the hub to bind?
-  {
-    // check if there is a valid id in the data
-    const uint8_t id[] = {'E', 'M', 'M', 'M', 'A', '-', 'K'};
-
-    if(data_len == sizeof(id) && !memcmp(id, data, data_len))
-    {
-      // initialize hub address, save config and reboot...
-      memcpy((void *)broadcastAddressMidiHub.c_str(), mac_addr, 6);
+  StatsSnapshot s;
 
-      saveConfig();
+  portENTER_CRITICAL(&statsMux);
+  s = statsShown;
+  portEXIT_CRITICAL(&statsMux);
 
-      ESP.restart();
-    }
-  }
+  uint32_t stats[11 + numPins] = {s.loopsPerSecond, s.worstLoop, s.send50, s.send99, s.slaveErrors, s.espNowSent,
+    s.espNowFailed, s.rtt50, s.rtt99, s.bleInterval, s.freeHeap};
 
-  handleChangeRequest(data[0], data[1], data[2]);
+  for(int i = 0; i < numPins; i++)
+    stats[11 + i] = benchmark[i];
 
-  displayRefresh();
+  sysexReply(port, SYSEX_STATS, (const uint8_t *)stats, sizeof(stats));
 }
 
-// LittleFS calls for config
-void writeFile(String filename, String message)
+void sysexCommand(uint8_t port, uint8_t command)
 {
-    File file = LittleFS.open(filename, "w");
+  if(command == SYSEX_CONFIG_REQUEST)
+  {
+    StoredConfig c;
+    uint8_t record[CONFIG_RECORD_SIZE];
 
-    if(!file)
-    {
-      Serial.println("writeFile -> failed to open file for writing");
-      return;
-    }
+    configToStored(c);
 
-    if(file.print(message))
-    {
-      Serial.println("File written");
-    } 
-    else 
+    size_t length = configPack(record, &c, sizeof(c), CONFIG_VERSION, configSequence);
+
+    sysexReply(port, SYSEX_CONFIG, record, length);
+  }
+  else if(command == SYSEX_CONFIG)
+  {
+    uint16_t version;
+    uint32_t sequence;
+    bool ok = false;
+
+    if(!sysexConfigPending && !sysexParser.overflow)
     {
-      Serial.println("Write failed");
-    }
+      configToStored(sysexConfig); // the settings now for anything the record doesn't have
 
-    file.close();
-}
+      ok = configUnpack(sysexBuffer, sysexParser.length, &sysexConfig, sizeof(sysexConfig), version, sequence);
 
-String readFile(String filename)
-{
-  File file = LittleFS.open(filename);
+      if(ok && version < CONFIG_VERSION)
+        migrateConfig(sysexConfig, version);
+    }
+
+    if(ok)
+      sysexConfigPending = true; // a NAK leaves one already waiting alone
 
-  if(!file)
+    sysexReply(port, ok ? SYSEX_ACK : SYSEX_NAK, &command, 1);
+  }
+  else if(command == SYSEX_STATS_REQUEST)
   {
-    Serial.println("Failed to open file for reading");
-    return "";
+    sysexStats(port);
   }
-  
-  String fileText = "";
-  while(file.available())
+  else
   {
-    fileText = file.readString();
+    sysexReply(port, SYSEX_NAK, &command, 1);
   }
-
-  file.close();
-
-  return fileText;
 }
 
-const String config_filename = "/config.json";
-
-void saveConfig() 
+void sysexReceive(uint8_t port, const uint8_t *data, int length)
 {
-  StaticJsonDocument<1024> doc;
+  for(int i = 0; i < length; i++)
+  {
+    uint8_t command = sysexParse(sysexParser, data[i]);
 
-  // write variables to JSON file
-  doc["configInit"] = configInit;
-  doc["useBluetooth"] = useBluetooth;
-  doc["scaleIndex"] = scaleIndex;
-  doc["midiChannel"] = midiChannel;
-  doc["masterVolume"] = masterVolume;
-  doc["adjacentPinsFilter"] = adjacentPinsFilter;
-  doc["dissonantNotesFilter"] = dissonantNotesFilter;
-  doc["ccForModwheel"] = ccForModwheel;
-  doc["broadcastAddressMidiHub"] = broadcastAddressMidiHub;
-  
-  // write config file
-  String tmp = "";
-  serializeJson(doc, tmp);
-  writeFile(config_filename, tmp);
+    if(command != SYSEX_NONE)
+      sysexCommand(port, command);
+  }
 }
 
-bool readConfig() 
+// The MIDI library gives a SysEx longer than its SysExMaxSize in pieces. All but the last end with F0
+// and all but the first start with F7. Those are left out so the parser sees one message.
+void sysexReceivePiece(uint8_t port, const uint8_t *data, int length)
 {
-  String file_content = readFile(config_filename);
-
-  int config_file_size = file_content.length();
-  Serial.println("Config file size: " + String(config_file_size));
-
-  if(config_file_size == 0)
+  if(length > 0 && data[0] == 0xF7 && sysexParser.state != SYSEX_IDLE)
   {
-    Serial.println("Initializing config with defaults...");
-    saveConfig();
-
-    return false;
+    data++;
+    length--;
   }
 
-  if(config_file_size > 1024) 
+  if(length > 1 && data[length - 1] == 0xF0)
+    length--;
+
+  sysexReceive(port, data, length);
+}
+
+void receiveEspNowSysex()
+{
+  while(espNowSysexTail != espNowSysexHead)
   {
-    Serial.println("Config file too large");
-    return false;
+    uint8_t byte = espNowSysex[espNowSysexTail];
+
+    espNowSysexTail = espNowSysexTail + 1;
+    sysexReceive(PORT_ESPNOW, &byte, 1);
   }
+}
 
-  StaticJsonDocument<1024> doc;
+// From loop() before the pins are read
+void applySysexConfig()
+{
+  if(!allNotesOff())
+    return;
 
-  auto error = deserializeJson(doc, file_content);
+  uint8_t oldProfile = touchProfile;
 
-  if(error) 
-  { 
-    Serial.println("Error interpreting config file");
-    return false;
-  }
+  configFromStored(sysexConfig);
+  sysexConfigPending = false;
+  applyConfigChanges(oldProfile);
+}
 
-  const String _configInit = doc["configInit"];
-  const bool _useBluetooth = doc["useBluetooth"];
-  const int _scaleIndex = doc["scaleIndex"];
-  const int _midiChannel = doc["midiChannel"];
-  const int _masterVolume = doc["masterVolume"];
-  const int _adjacentPinsFilter = doc["adjacentPinsFilter"];
-  const int _dissonantNotesFilter = doc["dissonantNotesFilter"];
-  const int _ccForModwheel = doc["ccForModwheel"];
-  const String _broadcastAddressMidiHub = doc["broadcastAddressMidiHub"];
-  
+// All the MIDI that has come in since the last pass (up to CHANGE_REQUESTS_MAX messages in case of a
+// flood) and one display refresh at the end if anything shown has changed.
+#define CHANGE_REQUESTS_MAX 64
 
-  Serial.print("_configInit: ");
-  Serial.println(_configInit);
+void processChangeRequests()
+{
+  bool refresh = false;
 
-  if(_configInit != configInit) // Have we initialized the config yet?
+  if(midiOn)
   {
-    Serial.println("Initializing config to default values...");
-    saveConfig(); // init with default values
+    for(int i = 0; i < CHANGE_REQUESTS_MAX && USBMIDI.read(); i++)
+    {
+      uint8_t type = USBMIDI.getType();
+
+      if(type == midi::SystemExclusive)
+        sysexReceivePiece(PORT_USB, USBMIDI.getSysExArray(), USBMIDI.getSysExArrayLength());
+      else if(handleChangeRequest(type, USBMIDI.getData1(), USBMIDI.getData2()))
+        refresh = true;
+    }
   }
-  else
+  else if(useBluetooth && bluetoothConnected)
   {
-    configInit = _configInit;
-    useBluetooth = _useBluetooth;
-    scaleIndex = _scaleIndex;
-    midiChannel = _midiChannel;
-    masterVolume = _masterVolume;
-    adjacentPinsFilter = _adjacentPinsFilter;
-    dissonantNotesFilter = _dissonantNotesFilter;
-    ccForModwheel = _ccForModwheel;
-    memcpy((void *)broadcastAddressMidiHub.c_str(), _broadcastAddressMidiHub.c_str(), 6);
-    
+    for(int i = 0; i < CHANGE_REQUESTS_MAX && MIDI.read(); i++)
+    {
+      uint8_t type = MIDI.getType();
+
+      if(type == midi::SystemExclusive)
+        sysexReceivePiece(PORT_BLE, MIDI.getSysExArray(), MIDI.getSysExArrayLength());
+      else if(handleChangeRequest(type, MIDI.getData1(), MIDI.getData2()))
+        refresh = true;
+    }
   }
 
-  Serial.println(configInit);
-  Serial.println(useBluetooth);
-  Serial.println(scaleIndex);
-  Serial.println(midiChannel);
-  Serial.println(masterVolume);
+  if(changeRequestRefresh)
+  {
+    changeRequestRefresh = false;
+    refresh = true;
+  }
 
-  return true;
+  if(refresh)
+    displayRefresh();
 }
 
 void BleOnConnected()
@@ -1264,17 +3716,23 @@ void setup()
 {
   Serial.begin(115200);
 
-#if 1
+  setupChangeHandlers();
+
+  // LittleFS is only needed to bring over config.json from older firmware
   if(!LittleFS.begin(true))
-  {
-      Serial.println("LittleFS Mount Failed");
-      return;
-  }
-  else
-  {
-    readConfig(); 
-  }
-#endif
+    Serial.println("LittleFS Mount Failed");
+
+  startConfigTask();
+
+  initPresets();
+
+  readConfig();
+
+  sysexInit(sysexParser, sysexBuffer, sizeof(sysexBuffer));
+
+  compileRoutes();
+
+  buildPresetTables();
 
   // need to do this to force the scale to be loaded in case it isn't major scale...
   handleChangeRequest(176, 68, scaleIndex + 1);
@@ -1303,6 +3761,11 @@ void setup()
 
   display.display();
 
+  // from here on the display is sent by its own task
+  display.startTask(displayFrameSent);
+
+  startUiTask();
+
   //Serial.println("Initializing touchpad");
   touch_pad_init();
 
@@ -1344,6 +3807,8 @@ void setup()
 
   touch_pad_set_voltage(TOUCH_HVOLT_2V7, TOUCH_LVOLT_0V5, TOUCH_HVOLT_ATTEN_1V);
 
+  touchProfileHardware();
+
   touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
   touch_pad_fsm_start();
 
@@ -1371,6 +3836,9 @@ void setup()
   }
   Serial.println();
 
+  updateTouchLevels();
+  measureTouchProfile();
+
   pixels.setBrightness(10);
   pixels.begin(); // INITIALIZE NeoPixel (REQUIRED)
 
@@ -1407,7 +3875,7 @@ void setup()
       esp_now_register_recv_cb(data_received);
 
       esp_now_peer_info_t peerInfo1 = {}; // must be initialized to 0
-      memcpy(peerInfo1.peer_addr, (void *)broadcastAddressMidiHub.c_str(), 6);
+      memcpy(peerInfo1.peer_addr, broadcastAddressMidiHub, 6);
       peerInfo1.channel = 0;  
       peerInfo1.encrypt = false;     
 
@@ -1453,14 +3921,23 @@ void setup()
     display.println(F("Binding to hub..."));
     display.display();
 
-    while(true)
+    while(true) // loop() never runs while binding so the restart after the bind is done here
+    {
+      if(restartRequested && configSaved())
+        ESP.restart();
+
       delay(100);  
+    }
   }
 
   display.clearDisplay();
   display.setTextSize(1);  
 
-  mode = "Note";
+  display.buildGlyphCache();
+  noteNamesBuild(noteNames);
+  benchmarkNotesDisplay();
+
+  mode = MODE_NOTE;
   displayNotes(true);
 }
 
@@ -1586,6 +4063,12 @@ bool adjacentPinOn(int pin)
       break;
   }
 
+  if(pin < notePins && crosstalkCompensated())
+  {
+    // the leakage between master pins is compensated so only the slave neighbour of the middle pin is left
+    result = pin == 0 && notePinsOn[1];
+  }
+
   if(enableAdjacentPins)
     return false;
   else
@@ -1655,7 +4138,7 @@ void sendChordEspNow3(uint8_t *chordData)
 // Note that notes for chords are sent in reverse order in case the instrument can't handle chords (only the last note sent will play)
 void sendChordOn(uint8_t idx, uint8_t ofs)
 {
-  if(scales[scaleIndex] == "Major" || scales[scaleIndex] == "Minor")
+  if(scaleIs("Major") || scaleIs("Minor"))
   {
     if(midiOn)
     {
@@ -1672,7 +4155,7 @@ void sendChordOn(uint8_t idx, uint8_t ofs)
     }
     
   }
-  else if(scales[scaleIndex] == "Major Pentatonic")
+  else if(scaleIs("Major Pentatonic"))
   {
     switch(idx % 5)
     {
@@ -1727,7 +4210,7 @@ void sendChordOn(uint8_t idx, uint8_t ofs)
         break;
     }
   }
-  else if(scales[scaleIndex] == "Minor Pentatonic")
+  else if(scaleIs("Minor Pentatonic"))
   {
     switch(idx % 5)
     {
@@ -1782,7 +4265,7 @@ void sendChordOn(uint8_t idx, uint8_t ofs)
         break;
     }
   }
-  else if(scales[scaleIndex] == "Minor Blues")
+  else if(scaleIs("Minor Blues"))
   {
     switch(idx % 6)
     {
@@ -1909,7 +4392,7 @@ void sendChordOn(uint8_t idx, uint8_t ofs)
 
 void sendChordOff(uint8_t idx, uint8_t ofs)
 {
-  if(scales[scaleIndex] == "Major" || scales[scaleIndex] == "Minor")
+  if(scaleIs("Major") || scaleIs("Minor"))
   {
     if(midiOn)
     {
@@ -1925,7 +4408,7 @@ void sendChordOff(uint8_t idx, uint8_t ofs)
       sendChordEspNow3(chordData3);
     }
   }
-  else if(scales[scaleIndex] == "Major Pentatonic")
+  else if(scaleIs("Major Pentatonic"))
   {
     switch(idx % 5)
     {
@@ -1980,7 +4463,7 @@ void sendChordOff(uint8_t idx, uint8_t ofs)
         break;
     }
   }
-  else if(scales[scaleIndex] == "Minor Pentatonic")
+  else if(scaleIs("Minor Pentatonic"))
   {
     switch(idx % 5)
     {
@@ -2035,7 +4518,7 @@ void sendChordOff(uint8_t idx, uint8_t ofs)
         break;
     }
   }
-  else if(scales[scaleIndex] == "Minor Blues")
+  else if(scaleIs("Minor Blues"))
   {
     switch(idx % 6)
     {
@@ -2207,10 +4690,7 @@ void processRemoteNotes(bool touched, int i)
         }
       }
 
-      if(playChords && chordSupported())
-        displayChords(false);
-      else
-        displayNotes(false);
+      notesChanged();
 
       showNoteColour(midiValues[1 + (i * 2)]);
     }
@@ -2247,10 +4727,7 @@ void processRemoteNotes(bool touched, int i)
         }
       }
 
-      if(playChords && chordSupported())
-        displayChords(false);
-      else
-        displayNotes(false);        
+      notesChanged();
     }
   }
 }
@@ -2270,15 +4747,15 @@ bool allNotesOff()
 
 void displayRefresh()
 {
-  if(mode == "Scale")
+  if(mode == MODE_SCALE)
   {
     displayScale();
   }
-  else if(mode == "Key")
+  else if(mode == MODE_KEY)
   {
     displayKey();
   }
-  else if(mode == "Octave")
+  else if(mode == MODE_OCTAVE)
   {
     displayOctave();
   }
@@ -2291,7 +4768,7 @@ bool toggleRelativeMajorMinor()
   if(!allNotesOff())
     return result;  // don't want to do this if any notes are on...
 
-  if(scales[scaleIndex] == "Major" || scales[scaleIndex] == "Major Pentatonic")
+  if(scaleIs("Major") || scaleIs("Major Pentatonic"))
   {
     result = true;
 
@@ -2315,7 +4792,7 @@ bool toggleRelativeMajorMinor()
       octave--;
     }
 
-    if(scales[scaleIndex] == "Minor")
+    if(scaleIs("Minor"))
     {
       scaleToMidiValues(minorscale, sizeof(minorscale));
     }
@@ -2324,7 +4801,7 @@ bool toggleRelativeMajorMinor()
       scaleToMidiValues(minorpentascale, sizeof(minorpentascale));
     }
   }
-  else if(scales[scaleIndex] == "Minor" || scales[scaleIndex] == "Minor Pentatonic")
+  else if(scaleIs("Minor") || scaleIs("Minor Pentatonic"))
   {
     result = true;
 
@@ -2348,7 +4825,7 @@ bool toggleRelativeMajorMinor()
       octave++;
     }
 
-    if(scales[scaleIndex] == "Major")
+    if(scaleIs("Major"))
       scaleToMidiValues(majorscale, sizeof(majorscale));
     else
       scaleToMidiValues(pentascale, sizeof(pentascale));
@@ -2359,136 +4836,370 @@ bool toggleRelativeMajorMinor()
   return result;
 }
 
-void processPitchBend()
+// Gestures (see gestures.h) are detected by the IMU task and queued for loop() to act on with
+// the action set in the config for each one.
+QueueHandle_t gestureQueue = NULL;
+bool gestureToggled[GESTURES] = {false}; // the state of Sustain and CC Toggle
+uint8_t gestureNote = 0;
+uint32_t gestureNoteOffMillis = 0;
+const uint32_t gestureNoteLength = 200; // ms
+
+bool gesturesUsed()
 {
-  static bool offsetCaptured = false;
-  static double pitchOffset = 0.0;
-  static double lastBendxWithExpo = 0.0;
+  for(int i = 0; i < GESTURES; i++)
+  {
+    if(gestureActions[i] != ACTION_OFF)
+      return true;
+  }
+
+  return false;
+}
+
+void processGestures()
+{
+  uint8_t event;
+  uint8_t control = 0xB0 | ((midiChannel - 1) & 0x0F);
+  uint8_t note = 0x90 | ((midiChannel - 1) & 0x0F);
+  bool sent = false;
+
+  if(gestureNote && (int32_t)(millis() - gestureNoteOffMillis) >= 0)
+  {
+    midiMessageAdd(note, gestureNote, 0);
+    gestureNote = 0;
+    sent = true;
+  }
+
+  while(gestureQueue && xQueueReceive(gestureQueue, &event, 0))
+  {
+    uint8_t gesture = event - 1;
+    uint8_t param = gestureParams[gesture] & 0x7F;
+
+    switch(gestureActions[gesture])
+    {
+      case ACTION_SUSTAIN:
+        gestureToggled[gesture] = !gestureToggled[gesture];
+        midiMessageAdd(control, 64, gestureToggled[gesture] ? 127 : 0);
+        sent = true;
+        break;
+
+      case ACTION_CC_TOGGLE:
+        gestureToggled[gesture] = !gestureToggled[gesture];
+        midiMessageAdd(control, param, gestureToggled[gesture] ? 127 : 0);
+        sent = true;
+        break;
+
+      case ACTION_OCTAVE_UP:
+      case ACTION_OCTAVE_DOWN:
+        if(allNotesOff()) // same as the option pins, no octave change with notes on
+        {
+          changeOctave(gestureActions[gesture] == ACTION_OCTAVE_UP);
+
+          if(optionsMode)
+            displayRefresh();
+        }
+        break;
+
+      case ACTION_NOTE:
+        if(gestureNote)
+          midiMessageAdd(note, gestureNote, 0);
+
+        gestureNote = param;
+        gestureNoteOffMillis = millis() + gestureNoteLength;
+        midiMessageAdd(note, gestureNote, masterVolume);
+        sent = true;
+        break;
+
+      case ACTION_NEXT_PRESET:
+        requestPreset((currentPreset + 1) % PRESETS);
+        break;
+    }
+  }
+
+  if(sent)
+    midiMessageFlush();
+}
+
+// Continuous pressure (enabled with "Pressure Output" in the config).
+// While a master note pin is held, how far its raw value is above the note on threshold is mapped
+// to 0 - 127 and sent as polyphonic aftertouch, or as channel pressure using the highest held pin.
+// So that 17 pins at full scan rate don't flood BLE or ESP-Now the pressures are only looked at every
+// pressureInterval ms, only changes of at least pressureDeadband are sent and no more than
+// pressureMaxPerFrame messages go out at a time, the most changed first.
+const uint32_t pressureInterval = 10; // ms
+const uint8_t pressureDeadband = 2;
+const uint8_t pressureMaxPerFrame = 4;
+const float pressureRange = 0.5; // this much above the note on threshold (fraction of benchmark) is full pressure
+
+uint8_t pinPressure[notePins] = {0};  // latest pressure of each held master note pin
+uint8_t sentPressure[notePins] = {0}; // last pressure sent for it
+uint8_t pressureNote[notePins] = {0}; // the note it was sent with (the root note of a chord)
+uint8_t sentChannelPressure = 0;
+
+uint8_t touchPressure(int i, uint32_t touch_value)
+{
+  uint32_t onValue = touchOnLevel[i];
+
+  if(touch_value <= onValue)
+    return 0;
+
+  uint32_t p = (touch_value - onValue) * 127 / (uint32_t)(pressureRange * benchmark[i]);
+
+  if(p > 127)
+    p = 127;
+
+  return p;
+}
+
+void processPressure()
+{
+  static uint32_t lastPressureMillis = 0;
+
+  if(pressureMode == 0 || millis() - lastPressureMillis < pressureInterval)
+    return;
+
+  lastPressureMillis = millis();
+
+  if(pressureMode == 1)
+  {
+    // polyphonic aftertouch, collect the pins that changed enough and send the biggest changes first
+    uint8_t changed[notePins];
+    uint8_t change[notePins];
+    int n = 0;
+
+    for(int i = 0; i < notePins; i++)
+    {
+      if(notePinsOn[i * 2])
+      {
+        int d = abs((int)pinPressure[i] - (int)sentPressure[i]);
 
-  double pitch;
+        if(d >= pressureDeadband)
+        {
+          changed[n] = i;
+          change[n] = d;
+          n++;
+        }
+      }
+    }
+
+    for(int k = 0; k < n && k < pressureMaxPerFrame; k++)
+    {
+      int best = k;
+
+      for(int j = k + 1; j < n; j++)
+      {
+        if(change[j] > change[best])
+          best = j;
+      }
+
+      uint8_t i = changed[best];
+      changed[best] = changed[k];
+      change[best] = change[k];
+
+      midiMessageAdd(0xA0 | (midiChannel - 1), pressureNote[i], pinPressure[i]);
+      sentPressure[i] = pinPressure[i];
+    }
+  }
+  else
+  {
+    // channel pressure follows the hardest pressed pin
+    uint8_t pressure = 0;
+
+    for(int i = 0; i < notePins; i++)
+    {
+      if(notePinsOn[i * 2] && pinPressure[i] > pressure)
+        pressure = pinPressure[i];
+    }
+
+    if(abs((int)pressure - (int)sentChannelPressure) >= pressureDeadband || (pressure == 0 && sentChannelPressure != 0))
+    {
+      midiMessageAdd(0xD0 | (midiChannel - 1), pressure, 0);
+      sentChannelPressure = pressure;
+    }
+  }
+
+  midiMessageFlush();
+}
 
-  pitch = ypr[2] * 180/M_PI; // This is actually pitch the way it is mounted
+// The controller routes (see controller_routes.h). The tilt angles are binary angles (65536 is a full
+// turn) straight from the quaternion and the response comes from the curve tables built by
+// compileRoutes() so there is no floating point maths here. The tilt sources are relative to where the
+// instrument was when option1 was touched, the offsets are subtracted in int16 so the result is right
+// even if the angle wraps around. Nothing is sent for a route unless its value has changed.
+int32_t routeInput(uint8_t source, const int16_t *offsets)
+{
+  switch(source)
+  {
+    case SOURCE_PITCH:
+      return (int16_t)(-tilt.roll - offsets[SOURCE_PITCH]); // This is actually pitch the way it is mounted
+
+    case SOURCE_ROLL:
+      return (int16_t)(tilt.pitch - offsets[SOURCE_ROLL]);  // ...and roll
+
+    case SOURCE_YAW:
+      return (int16_t)(tilt.yaw - offsets[SOURCE_YAW]);
 
-  pitch *= -1.0;
+    case SOURCE_PRESSURE:
+    {
+      uint8_t pressure = 0;
+
+      for(int i = 0; i < notePins; i++)
+      {
+        if(notePinsOn[i * 2] && pinPressure[i] > pressure)
+          pressure = pinPressure[i];
+      }
 
-  if(option1 && !offsetCaptured)
-  {
-    offsetCaptured = true;
-    pitchOffset = pitch;
-  }
-  else if(!option1)
-  {
-    offsetCaptured = false;
-  }
+      return pressure * ROUTE_FULL_SCALE / 127;
+    }
 
-  // calculate the desired 0 position 
-  pitch -= pitchOffset; 
+    case SOURCE_OPTION1:
+      return option1 ? ROUTE_FULL_SCALE : 0;
 
-  double bendX = pitch / 30.0; // 30 deg for full pitch range   
+    case SOURCE_OPTION2:
+      return option2 ? ROUTE_FULL_SCALE : 0;
 
-  if(bendX > 1.0)
-    bendX = 1.0;
-  else if(bendX < -1.0)
-    bendX = -1.0;
+    case SOURCE_OPTION3:
+      return option3 ? ROUTE_FULL_SCALE : 0;
 
-  const double MaxExpo = 5.0;  
-  const double a1 = 30.0; // 30%           
-  double a2 = a1/100.0 * MaxExpo; 
-  double a3 = 1.0 / exp(a2);         
-  double bendxWithExpo = bendX * exp(fabs(a2 * bendX)) * a3;     
-  
-  //if(bendxWithExpo != lastBendxWithExpo)
-  if(true)
-  {
-    lastBendxWithExpo = bendxWithExpo;
+    case SOURCE_OPTION4:
+      return option4 ? ROUTE_FULL_SCALE : 0;
 
-    pitchBend(bendxWithExpo);  
+    case SOURCE_OPTION5:
+      return option5 ? ROUTE_FULL_SCALE : 0;
   }
+
+  return 0;
 }
 
-void processModwheel()
+void processRoutes()
 {
   static bool offsetCaptured = false;
-  static double rollOffset = 0.0;
-  static uint8_t lastMod = 63;
-
-  double roll = ypr[1] * 180/M_PI;  // ...and roll
+  static int16_t offsets[3] = {0, 0, 0}; // pitch, roll and yaw
 
   if(option1 && !offsetCaptured)
   {
     offsetCaptured = true;
-    rollOffset = roll;
+    offsets[SOURCE_PITCH] = -tilt.roll;
+    offsets[SOURCE_ROLL] = tilt.pitch;
+    offsets[SOURCE_YAW] = tilt.yaw;
   }
   else if(!option1)
   {
     offsetCaptured = false;
   }
 
-  // calculate the desired 0 position 
-  roll -= rollOffset; 
+  for(int i = 0; i < compiledRouteCount; i++)
+  {
+    CompiledRoute &route = compiledRoutes[i];
+    int32_t value;
+
+    if(!(route.flags & ROUTE_GATED) || option1)
+    {
+      value = routeValue(route, routeInput(route.source, offsets));
+      route.active = true;
+    }
+    else if(route.active)
+    {
+      // Send the rest value once when option1 removed
+      value = routeRest(route);
+      route.active = false;
+    }
+    else
+    {
+      continue;
+    }
+
+    if(value == route.last)
+      continue;
 
-  int iRoll = roll / 25.0 * 64; 
-  if(iRoll < -64)
-    iRoll = -64;
-  else if (iRoll > 63)
-    iRoll = 63;
+    route.last = value;
 
-  uint8_t mod;
-  if(iRoll < 0)
-    mod = -iRoll * 2;
-  else
-    mod =  iRoll * 2;
+    switch(route.destination)
+    {
+      case DEST_PITCH_BEND:
+        pitchBend((value - 8192) / 8192.0);
+        break;
 
-  if(mod > 127)
-    mod = 127;
+      case DEST_CC:
+        controlChange(route.param, value >> 7);
+        break;
 
-  // only send the modwheel data if it has changed
-  //if(mod != lastMod)
-  if(true)
-  {
-    lastMod = mod;
+      case DEST_CC14:
+        controlChange14(route, value);
+        break;
 
-    modwheel(mod);
+      case DEST_CHANNEL_PRESSURE:
+        midiMessageAdd(0xD0 | ((midiChannel - 1) & 0x0F), value >> 7, 0);
+        break;
+    }
   }
+
+  midiMessageFlush();
 }
 
 void loop() 
 {
   uint32_t touch_value;
 
+  static uint32_t lastLoopMicros = micros();
+  uint32_t loopMicros = micros() - lastLoopMicros;
+
+  lastLoopMicros += loopMicros;
+  loopCount++;
+
+  if(loopMicros > loopWorstMicros)
+    loopWorstMicros = loopMicros;
+
   if(SERIALSLAVE.availableForWrite())
     SERIALSLAVE.write(0xA5);
 
+  if(pendingPreset >= 0)
+    applyPendingPreset();
+
+  if(espNowSysexTail != espNowSysexHead)
+    receiveEspNowSysex();
+
+  if(sysexConfigPending)
+    applySysexConfig();
+
     // read and process the right option pins
 
-    touch_pad_read_raw_data(pins[9], &touch_value);   // right top (on PCB) option pin
-    if(touch_value > benchmark[9] + (0.3 * benchmark[9]))
+    readTouchPin(9, &touch_value);   // right top (on PCB) option pin
+    if(touch_value > touchOnLevel[9])
       option1 = true;
-    else if(touch_value < benchmark[9] + (0.2 * benchmark[9]))
+    else if(touch_value < touchOffLevel[9])
       option1 = false;
 
-    touch_pad_read_raw_data(pins[10], &touch_value);   // right middle (on PCB) option pin
-    if(touch_value > benchmark[10] + (0.3 * benchmark[10]))
+    readTouchPin(10, &touch_value);   // right middle (on PCB) option pin
+    if(touch_value > touchOnLevel[10])
       option2 = true;
-    else if(touch_value < benchmark[10] + (0.2 * benchmark[10]))
+    else if(touch_value < touchOffLevel[10])
       option2 = false;
 
-    touch_pad_read_raw_data(pins[11], &touch_value);   // right bottom (on PCB) option pin
-    if(touch_value > benchmark[11] + (0.3 * benchmark[11]))
+    readTouchPin(11, &touch_value);   // right bottom (on PCB) option pin
+    if(touch_value > touchOnLevel[11])
       option3 = true;
-    else if(touch_value < benchmark[11] + (0.2 * benchmark[11]))
+    else if(touch_value < touchOffLevel[11])
       option3 = false;
 
   // The master has 9 note pins which correspond to the even midiValues[]
+  // All of them are read first so the cross-talk between them can be taken out.
+  uint32_t noteTouchValues[notePins];
+  uint32_t readMicros = micros(); // for the touch to send time, the sweep itself may be up to one period older
+
+  for(int i = 0; i < notePins; i++)
+    readTouchPin(i, &noteTouchValues[i]);
+
+  if(crosstalkCompensated())
+    compensateCrosstalk(noteTouchValues);
 
   for(int i = 0; i < notePins; i++)
   {
     uint8_t idx = (i * 2); 
     uint8_t ofs = key + octave * 12;
 
-    touch_pad_read_raw_data(pins[i], &touch_value);
+    touch_value = noteTouchValues[i];
 
-    if(touch_value > benchmark[i] + (0.3 * benchmark[i]) && !adjacentPinOn(i)  && !dissonantNoteOn(i * 2))
+    if(touch_value > touchOnLevel[i] && !adjacentPinOn(i)  && !dissonantNoteOn(i * 2))
     {
       if(dissonantNoteOn(i * 2))
       {
@@ -2498,6 +5209,9 @@ void loop()
       if(!notePinsOn[i * 2])
       {
         notePinsOn[i * 2] = true;
+        pinPressure[i] = 0;
+        sentPressure[i] = 0;
+        pressureNote[i] = midiValues[idx] + ofs;
 
         if(option4)
         {
@@ -2530,15 +5244,14 @@ void loop()
           }
         }
 
-      if(playChords  && chordSupported())
-        displayChords(false);
-      else
-        displayNotes(false);
+        histogramAdd(sendLatency, micros() - readMicros);
+
+        notesChanged();
         
         showNoteColour(midiValues[i * 2]);
       }
     }
-    else if(touch_value < benchmark[i] + (0.2 * benchmark[i]))
+    else if(touch_value < touchOffLevel[i])
     {
       if(notePinsOn[i * 2])
       {
@@ -2570,13 +5283,15 @@ void loop()
           }
         }
         
-      if(playChords && chordSupported())
-        displayChords(false);
-      else
-        displayNotes(false);        
+      notesChanged();
       }
     }
+
+    if((pressureMode || pressureRouted) && notePinsOn[i * 2])
+      pinPressure[i] = touchPressure(i, touch_value);
   }
+
+  processPressure();
    
   float ax;
   float ay; 
@@ -2587,20 +5302,37 @@ void loop()
   static uint32_t lastOption4millis = t0;
   static bool option4Touched = false;
 
-  // This is the pitchbend and modwheel stuff. Only do every 25ms
+  // This is the pitchbend and modwheel stuff. The MPU6050 is read by its own task on the other core
+  // so the routes are updated whenever it has a new reading (at the DMP rate), or every 10ms for
+  // the pressure and option pin sources if the tilt hasn't changed.
+  static uint32_t lastRoutesMillis = 0;
+
+  if(MPU6050Loop() || millis() - lastRoutesMillis >= 10)
+  {
+    lastRoutesMillis = millis();
+
+    processRoutes();
+  }
+
+  processGestures();
+
+  // Only do every 25ms
   if(millis() - t0 > 25)
   {
     t0 = millis();
 
-    // The MPU6050 processing. Pitch is used for pitch bend and roll for modwheel
+    messageUpdate(); // for pop-up message timing
 
-    MPU6050Loop();
+    printImuStats();
 
-    messageUpdate(false); // for pop-up message timing
+    printDisplayStats();
 
-    processPitchBend();
+    updateStats();
 
-    processModwheel();
+    processSerialConfig();
+
+    if(restartRequested && configSaved())
+      ESP.restart();
   }
 
   // Read two bytes from the slave asynchronously. The first byte has the MSB set and
@@ -2610,11 +5342,16 @@ void loop()
     uint8_t c;
     static uint8_t c1 = 0;
     static uint8_t lastc = 0;
+    static bool firstByte = false;
       
     SERIALSLAVE.read(&c, 1);
 
     if(c & 0x80) // is it the first byte?
     {
+      if(firstByte) // the second byte of the last pair was lost
+        slaveLinkErrors++;
+
+      firstByte = true;
       c1 = c; // just save it
       if(c != lastc)
       {
@@ -2625,6 +5362,11 @@ void loop()
     }
     else 
     {
+      if(!firstByte) // the first byte of this pair was lost
+        slaveLinkErrors++;
+
+      firstByte = false;
+
       // second byte received
       // first process the first byte
       int i;
@@ -2661,11 +5403,11 @@ void loop()
           {
             Serial.println("Toggle relative major/minor");
             bool success = toggleRelativeMajorMinor();
-            String msg;
+            char msg[32];
             if(success)
-              msg = "To " + scales[scaleIndex];
+              snprintf(msg, sizeof(msg), "To %s", scales[scaleIndex]);
             else
-              msg = "Scale not supported  or note on";
+              snprintf(msg, sizeof(msg), "Scale not supported  or note on");
 
             displayMessage(msg);
           }
@@ -2700,17 +5442,17 @@ void loop()
         //Serial.println(optionsMode);
         if(optionsMode)
         {
-          if(mode == "Scale")
+          if(mode == MODE_SCALE)
           {
             changeScale(true);
             displayScale();
           }
-          else if(mode == "Key")
+          else if(mode == MODE_KEY)
           {
             changeKey(true);
             displayKey();
           }
-          else if(mode == "Octave")
+          else if(mode == MODE_OCTAVE)
           {
             changeOctave(true);
             displayOctave();
@@ -2732,17 +5474,17 @@ void loop()
       {
         if(optionsMode)
         {
-          if(mode == "Scale")
+          if(mode == MODE_SCALE)
           {
             changeScale(false);
             displayScale();
           }
-          else if(mode == "Key")
+          else if(mode == MODE_KEY)
           {
             changeKey(false);
             displayKey();
           }
-          else if(mode == "Octave")
+          else if(mode == MODE_OCTAVE)
           {
             changeOctave(false);
             displayOctave();
@@ -2761,6 +5503,32 @@ void loop()
 
       lastOption3 = option3;
 
+      // A tap on option5 recalls the next preset, held for 2 seconds the settings now are stored in
+      // the preset that was last recalled
+      static bool lastOption5 = false;
+      static uint32_t option5Millis = 0;
+      static bool option5Held = false;
+
+      if(!option5Routed)
+      {
+        if(option5 && !lastOption5)
+        {
+          option5Millis = millis();
+          option5Held = false;
+        }
+
+        if(option5 && !option5Held && millis() - option5Millis > 2000)
+        {
+          option5Held = true;
+          storePreset();
+        }
+
+        if(!option5 && lastOption5 && !option5Held)
+          requestPreset((currentPreset + 1) % PRESETS);
+      }
+
+      lastOption5 = option5;
+
       // Handle the adjacentPins and dissonantNotes filters
       if(playChords)
       {
@@ -2852,32 +5620,7 @@ void loop()
   }
 #endif
 
-  if(midiOn)
-  {
-    if(USBMIDI.read())
-    {
-      uint8_t type = USBMIDI.getType();
-      uint8_t data1 = USBMIDI.getData1();
-      uint8_t data2 = USBMIDI.getData2();
-
-      handleChangeRequest(type, data1, data2);
-
-      displayRefresh();
-    }
-  }
-  else if(useBluetooth && bluetoothConnected)
-  {
-    if(MIDI.read())
-    {
-      uint8_t type = MIDI.getType();
-      uint8_t data1 = MIDI.getData1();
-      uint8_t data2 = MIDI.getData2();
-
-      handleChangeRequest(type, data1, data2);
-
-      displayRefresh();
-    }
-  }
+  processChangeRequests();
 }
 
 void handleNoteOn(byte channel, byte pitch, byte velocity)
@@ -2910,6 +5653,7 @@ void handleNoteOff(byte channel, byte pitch, byte velocity)
 #include "I2Cdev.h"
 
 #include "MPU6050_6Axis_MotionApps20.h"
+#include "imu_fusion.h"
 
 #if I2CDEV_IMPLEMENTATION == I2CDEV_ARDUINO_WIRE
     #include "Wire.h"
@@ -2919,13 +5663,42 @@ MPU6050 mpu(0x68, &Wire1);
 
 #define OUTPUT_READABLE_YAWPITCHROLL
 
+// The MPU6050 INT pin signals when the DMP has a new packet in its FIFO. The packets are read by
+// imuTask() on core 0 (loop() runs on core 1) so no I2C time is added to the touch scan. If the
+// INT line isn't wired the task still polls every 10ms.
+#define MPU_INT_PIN 40 // GPIO40 is next to the MPU6050 I2C pins (41 and 42), -1 if not wired
+
+TaskHandle_t imuTaskHandle = NULL;
+
+// The latest yaw/pitch/roll is published by the IMU task under a spinlock so loop() always gets
+// all three from the same packet
+portMUX_TYPE imuMux = portMUX_INITIALIZER_UNLOCKED;
+TiltAngles imuTilt;
+uint32_t imuSequence = 0; // incremented for every new reading
+
+#define IMU_STATS 0 // set to 1 to print the IMU reading interval (jitter) and read time every 10 seconds
+
+uint32_t imuReadings = 0;
+uint32_t imuIntervalMin = UINT32_MAX; // us between readings
+uint32_t imuIntervalMax = 0;
+uint32_t imuReadMicros = 0; // total time reading and working out the angles
+
+// In fusion mode (see "IMU Mode" in the config) the DMP isn't loaded. The raw gyro and accelerometer
+// are read at 1kHz, each a single 14 byte burst read, and fused by the Mahony filter in imu_fusion.h.
+// This skips the DMP firmware load and calibration loops at boot and the DMP's own filtering delay.
+const float fusionKp = 1.0;   // how quickly the tilt follows the accelerometer
+const float fusionKi = 0.02;  // how quickly gyro bias is trimmed out
+const float gyroRadiansPerLsb = M_PI / 180.0 / 16.4; // at +/-2000 deg/s full scale
+
+MahonyFilter fusion;
+
 // MPU control/status vars
-bool dmpReady = false;  // set true if DMP init was successful
+bool dmpReady = false;  // set true if DMP init was successful (or fusion mode is set up)
 uint8_t mpuIntStatus;   // holds actual interrupt status byte from MPU
 uint8_t devStatus;      // return status after each device operation (0 = success, !0 = error)
 uint16_t packetSize;    // expected DMP packet size (default is 42 bytes)
 uint16_t fifoCount;     // count of all bytes currently in FIFO
-uint8_t fifoBuffer[64]; // FIFO storage buffer
+uint8_t fifoBuffer[2][64]; // FIFO storage, double buffered by the IMU task
 
 // orientation/motion vars
 Quaternion q;           // [w, x, y, z]         quaternion container
@@ -2935,6 +5708,320 @@ VectorInt16 aaWorld;    // [x, y, z]            world-frame accel sensor measure
 VectorFloat gravity;    // [x, y, z]            gravity vector
 float euler[3];         // [psi, theta, phi]    Euler angle container
 
+void IRAM_ATTR mpuDataReady()
+{
+  BaseType_t woken = pdFALSE;
+
+  vTaskNotifyGiveFromISR(imuTaskHandle, &woken);
+
+  if(woken)
+    portYIELD_FROM_ISR();
+}
+
+// The raw accelerometer readings are at +/-8g in fusion mode so that a tap isn't clipped, the DMP
+// leaves them at +/-2g. The filter only uses the direction so it doesn't mind which.
+int32_t rawAccelPerG()
+{
+  return imuMode == IMU_FUSION ? 4096 : 16384;
+}
+
+// Set the MPU6050 up for raw readings at 1kHz
+void fusionSetup()
+{
+  mpu.setFullScaleGyroRange(MPU6050_GYRO_FS_2000);
+  mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_8);
+  mpu.setDLPFMode(MPU6050_DLPF_BW_188); // the least delay that still gives a 1kHz sample rate
+  mpu.setRate(0); // 1kHz / (1 + 0)
+  mpu.setIntDataReadyEnabled(true);
+
+  delay(20); // let the DLPF settle
+}
+
+// Start the filter at the current tilt, the gyro bias is taken out by the offset registers
+// and the filter's integral does the rest
+void fusionStart()
+{
+  int16_t ax, ay, az, gx, gy, gz;
+  int32_t accel[3] = {0, 0, 0};
+
+  for(int i = 0; i < 8; i++)
+  {
+    mpu.getMotion6(&ax, &ay, &az, &gx, &gy, &gz);
+
+    accel[0] += ax;
+    accel[1] += ay;
+    accel[2] += az;
+
+    delay(1);
+  }
+
+  fusionReset(fusion, fusionKp, fusionKi);
+  fusionStartFromAccel(fusion, accel[0], accel[1], accel[2]);
+}
+
+// The offsets from a good calibration are saved in the config and reused at boot so the full
+// calibration (the CalibrateAccel() and CalibrateGyro() loops) only runs when asked for or when
+// the saved offsets fail the drift check.
+void setImuOffsets()
+{
+  mpu.setXAccelOffset(imuOffsets[0]);
+  mpu.setYAccelOffset(imuOffsets[1]);
+  mpu.setZAccelOffset(imuOffsets[2]);
+  mpu.setXGyroOffset(imuOffsets[3]);
+  mpu.setYGyroOffset(imuOffsets[4]);
+  mpu.setZGyroOffset(imuOffsets[5]);
+}
+
+// Runs the full calibration, the MPU6050 must be flat and still. On the IMU task once it is running.
+void calibrateImu()
+{
+  uint32_t start = millis();
+
+  mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_2); // CalibrateAccel() takes 1g to be 16384
+  mpu.CalibrateAccel(6);
+  mpu.CalibrateGyro(6);
+
+  if(imuMode == IMU_FUSION)
+    mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_8);
+
+  mpu.PrintActiveOffsets();
+
+  imuOffsets[0] = mpu.getXAccelOffset();
+  imuOffsets[1] = mpu.getYAccelOffset();
+  imuOffsets[2] = mpu.getZAccelOffset();
+  imuOffsets[3] = mpu.getXGyroOffset();
+  imuOffsets[4] = mpu.getYGyroOffset();
+  imuOffsets[5] = mpu.getZGyroOffset();
+  imuOffsetsSaved = true;
+
+  Serial.printf("IMU calibrated in %ums\n", millis() - start);
+}
+
+// Checks the saved offsets against the MPU6050 as it is now (gyro at +/-2000 deg/s, see rawAccelPerG()).
+// If it is being held still the gyro should read close to 0 and gravity close to 1g. If it is moving
+// there's no way to tell so the offsets are kept.
+bool imuOffsetsDrifted()
+{
+  const int samples = 32;
+  const int32_t maxGyroDrift = 16;  // LSB, about 1 deg/s
+  const int32_t stillGyroSpread = 48; // LSB peak to peak, more than this and it is moving
+  const float maxGravityError = 0.06;
+
+  int16_t raw[6];
+  int32_t sum[6] = {0, 0, 0, 0, 0, 0};
+  int16_t low[3] = {INT16_MAX, INT16_MAX, INT16_MAX};
+  int16_t high[3] = {INT16_MIN, INT16_MIN, INT16_MIN};
+
+  for(int i = 0; i < samples; i++)
+  {
+    mpu.getMotion6(&raw[0], &raw[1], &raw[2], &raw[3], &raw[4], &raw[5]);
+
+    for(int j = 0; j < 6; j++)
+      sum[j] += raw[j];
+
+    for(int j = 0; j < 3; j++)
+    {
+      low[j] = min(low[j], raw[j + 3]);
+      high[j] = max(high[j], raw[j + 3]);
+    }
+
+    delay(2);
+  }
+
+  for(int j = 0; j < 3; j++)
+  {
+    if(high[j] - low[j] > stillGyroSpread)
+      return false; // moving
+  }
+
+  for(int j = 3; j < 6; j++)
+  {
+    if(abs(sum[j] / samples) > maxGyroDrift)
+      return true;
+  }
+
+  float ax = (float)sum[0] / samples;
+  float ay = (float)sum[1] / samples;
+  float az = (float)sum[2] / samples;
+  float gravity = sqrtf(ax * ax + ay * ay + az * az) / rawAccelPerG();
+
+  return fabsf(gravity - 1.0f) > maxGravityError;
+}
+
+// Use the saved offsets if they pass the drift check, otherwise calibrate and save them
+void setupImuOffsets()
+{
+  uint32_t start = millis();
+
+  if(imuOffsetsSaved)
+  {
+    setImuOffsets();
+
+    if(!imuOffsetsDrifted())
+    {
+      Serial.printf("Saved IMU offsets checked in %ums\n", millis() - start);
+      return;
+    }
+
+    Serial.println(F("Saved IMU offsets have drifted"));
+  }
+
+  calibrateImu();
+  saveConfig();
+}
+
+// Read the raw gyro and accelerometer and update the fusion quaternion
+bool fusionRead(int16_t *quaternion, int16_t *accel, int16_t *gyro)
+{
+  static uint32_t lastMicros = micros();
+  int16_t &ax = accel[0], &ay = accel[1], &az = accel[2];
+  int16_t &gx = gyro[0], &gy = gyro[1], &gz = gyro[2];
+
+  mpu.getMotion6(&ax, &ay, &az, &gx, &gy, &gz);
+
+  uint32_t now = micros();
+  float dt = (now - lastMicros) / 1000000.0f;
+  lastMicros = now;
+
+  if(dt <= 0.0f || dt > 0.05f)
+    dt = 0.001f; // after a stall don't integrate a big step
+
+  fusionUpdate(fusion, gx * gyroRadiansPerLsb, gy * gyroRadiansPerLsb, gz * gyroRadiansPerLsb, ax, ay, az, dt);
+
+  fusionQuaternionQ14(fusion, quaternion);
+
+  return true;
+}
+
+// Gestures are looked for in every reading. The DMP packet has the accelerometer at 8192 LSB/g (+/-4g)
+// and the raw readings are at 4096 LSB/g (+/-8g), the gyro is 16.4 LSB/deg/s in both.
+const GestureSettings gestureSettings = {
+  2000, 40,     // tap: 2g for no more than 40ms
+  800, 4, 800,  // shake: 0.8g back and forth 4 times in 800ms
+  300, 250, 0,  // flick: 300 deg/s for no more than 250ms about the x axis (pitch the way it is mounted)
+  400           // then nothing for 400ms
+};
+
+GestureDetector gestures;
+
+void detectGestures(const int16_t *quaternion, const int16_t *accel, const int16_t *gyro, int32_t accelPerG)
+{
+  int16_t gravity[3];
+  int16_t linear[3]; // mg
+  int16_t rate[3];   // deg/s
+
+  tiltGravity(quaternion, gravity);
+
+  for(int i = 0; i < 3; i++)
+  {
+    linear[i] = (int32_t)accel[i] * 1000 / accelPerG - gravity[i];
+    rate[i] = (int32_t)gyro[i] * 10 / 164;
+  }
+
+  uint8_t event = gestureUpdate(gestures, linear, rate, millis());
+
+  if(event != GESTURE_NONE)
+    xQueueSend(gestureQueue, &event, 0); // if loop() hasn't kept up the gesture is dropped
+}
+
+void imuTask(void *parameter)
+{
+  uint8_t current = 0;
+  int16_t quaternion[4];
+  int16_t accel[3];
+  int16_t gyro[3];
+  VectorInt16 dmpAccel;
+  VectorInt16 dmpGyro;
+  TiltAngles taskTilt = {0, 0, 0};
+  uint32_t lastReading = micros();
+
+  gestureReset(gestures, gestureSettings);
+
+  // wait for the INT pin, if it isn't wired poll at the DMP rate or every tick in fusion mode
+  const TickType_t timeout = imuMode == IMU_FUSION ? 1 : pdMS_TO_TICKS(10);
+
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, timeout);
+
+    if(imuCalibrateRequest)
+    {
+      calibrateImu();
+
+      if(imuMode == IMU_FUSION)
+        fusionStart();
+      else
+        mpu.resetFIFO();
+
+      imuCalibrateRequest = false;
+    }
+
+    uint32_t start = micros();
+    bool newReading = false;
+
+    if(imuMode == IMU_FUSION)
+    {
+      newReading = fusionRead(quaternion, accel, gyro);
+    }
+    else if(mpu.dmpGetCurrentFIFOPacket(fifoBuffer[current])) // read a packet from FIFO into the buffer not used last time
+    {
+      mpu.dmpGetQuaternion(quaternion, fifoBuffer[current]);
+      mpu.dmpGetAccel(&dmpAccel, fifoBuffer[current]);
+      mpu.dmpGetGyro(&dmpGyro, fifoBuffer[current]);
+
+      accel[0] = dmpAccel.x;
+      accel[1] = dmpAccel.y;
+      accel[2] = dmpAccel.z;
+      gyro[0] = dmpGyro.x;
+      gyro[1] = dmpGyro.y;
+      gyro[2] = dmpGyro.z;
+
+      current ^= 1;
+      newReading = true;
+    }
+
+    if(newReading)
+    {
+      // Tilt angles straight from the Q14 quaternion, yaw only if it is being used
+      tiltFromQuaternion(quaternion, taskTilt, yawRouted);
+
+      portENTER_CRITICAL(&imuMux);
+      imuTilt = taskTilt;
+      imuSequence++;
+      portEXIT_CRITICAL(&imuMux);
+
+      if(gesturesUsed())
+        detectGestures(quaternion, accel, gyro, imuMode == IMU_FUSION ? rawAccelPerG() : 8192);
+
+      uint32_t interval = start - lastReading;
+      lastReading = start;
+
+      if(interval < imuIntervalMin)
+        imuIntervalMin = interval;
+
+      if(interval > imuIntervalMax)
+        imuIntervalMax = interval;
+
+      imuReadMicros += micros() - start;
+      imuReadings++;
+    }
+  }
+}
+
+void startImuTask()
+{
+  gestureQueue = xQueueCreate(8, sizeof(uint8_t));
+
+  // from here on Wire1 is only used by the IMU task
+  xTaskCreatePinnedToCore(imuTask, "IMU", 4096, NULL, 2, &imuTaskHandle, 0);
+
+  if(MPU_INT_PIN >= 0)
+  {
+    pinMode(MPU_INT_PIN, INPUT_PULLDOWN);
+    attachInterrupt(MPU_INT_PIN, mpuDataReady, RISING);
+  }
+}
+
 void MPU6050Setup() 
 {
     // join I2C bus (I2Cdev library doesn't do this automatically)
@@ -2955,6 +6042,22 @@ void MPU6050Setup()
     Serial.println(F("Testing device connections..."));
     Serial.println(mpu.testConnection() ? F("MPU6050 connection successful") : F("MPU6050 connection failed"));
 
+    if(imuMode == IMU_FUSION)
+    {
+      uint32_t start = millis();
+
+      Serial.println(F("Starting sensor fusion..."));
+      fusionSetup();
+      setupImuOffsets();
+      fusionStart();
+      dmpReady = true;
+
+      Serial.printf("Sensor fusion ready in %ums\n", millis() - start);
+
+      startImuTask();
+      return;
+    }
+
     // load and configure the DMP
     Serial.println(F("Initializing DMP..."));
     devStatus = mpu.dmpInitialize();
@@ -2969,10 +6072,8 @@ void MPU6050Setup()
     // make sure it worked (returns 0 if so)
     if(devStatus == 0) 
     {
-        // Calibration Time: generate offsets and calibrate our MPU6050
-        mpu.CalibrateAccel(6);
-        mpu.CalibrateGyro(6);
-        mpu.PrintActiveOffsets();
+        // Calibration Time: use the saved offsets or generate them and calibrate our MPU6050
+        setupImuOffsets();
 
         // turn on the DMP, now that it's ready
         Serial.println(F("Enabling DMP..."));
@@ -2986,6 +6087,8 @@ void MPU6050Setup()
 
         // get expected DMP packet size for later comparison
         packetSize = mpu.dmpGetFIFOPacketSize();
+
+        startImuTask();
     } 
     else 
     {
@@ -2999,20 +6102,97 @@ void MPU6050Setup()
     }
 }
 
-void MPU6050Loop() 
+// Called from loop(), copies the latest reading from the IMU task into tilt. 
+// Returns true if there was a new one since last time.
+// Fusion runs at 1kHz but the controllers only go out at the DMP rate so there is no more MIDI
+// traffic, they just get the freshest reading.
+const uint32_t fusionOutputInterval = 10000; // us
+
+bool MPU6050Loop() 
 {
+    static uint32_t lastSequence = 0;
+    static uint32_t lastOutput = 0;
+
     // if programming failed, don't try to do anything
-    if (!dmpReady) return;
-
-    // read a packet from FIFO
-    if(mpu.dmpGetCurrentFIFOPacket(fifoBuffer)) 
-    { 
-      // Get the Latest packet 
-      #ifdef OUTPUT_READABLE_YAWPITCHROLL
-          // Euler angles in degrees
-          mpu.dmpGetQuaternion(&q, fifoBuffer);
-          mpu.dmpGetGravity(&gravity, &q);
-          mpu.dmpGetYawPitchRoll(ypr, &q, &gravity);
-      #endif
+    if (!dmpReady) return false;
+
+    if(imuMode == IMU_FUSION)
+    {
+      if(micros() - lastOutput < fusionOutputInterval)
+        return false;
+    }
+
+    bool newReading = false;
+
+    portENTER_CRITICAL(&imuMux);
+    if(imuSequence != lastSequence)
+    {
+      lastSequence = imuSequence;
+      tilt = imuTilt;
+      newReading = true;
     }
+    portEXIT_CRITICAL(&imuMux);
+
+    if(newReading)
+      lastOutput = micros();
+
+    return newReading;
+}
+
+uint32_t displayFrames = 0;
+uint32_t displaySendMax = 0;
+uint32_t displaySendMicros = 0;
+uint32_t displayBytes = 0;
+uint32_t displayLastFrameBytes = 0;
+
+// Called by the display task after each frame
+void displayFrameSent(uint32_t sendMicros, uint32_t bytes)
+{
+  displayFrames++;
+  displaySendMicros += sendMicros;
+  displayBytes += bytes;
+  displayLastFrameBytes = bytes;
+
+  if(sendMicros > displaySendMax)
+    displaySendMax = sendMicros;
+}
+
+void printDisplayStats()
+{
+#if DISPLAY_STATS
+  static uint32_t lastPrint = millis();
+
+  if(millis() - lastPrint > 10000 && displayFrames)
+  {
+    lastPrint = millis();
+
+    Serial.printf("Display: %u frames send %uus max %uus %u bytes/frame (full frame is %u)\n", displayFrames, 
+      displaySendMicros / displayFrames, displaySendMax, displayBytes / displayFrames, SCREEN_WIDTH * SCREEN_HEIGHT / 8);
+
+    displayFrames = 0;
+    displayBytes = 0;
+    displaySendMax = 0;
+    displaySendMicros = 0;
+  }
+#endif
+}
+
+void printImuStats()
+{
+#if IMU_STATS
+  static uint32_t lastPrint = millis();
+
+  if(millis() - lastPrint > 10000 && imuReadings)
+  {
+    lastPrint = millis();
+
+    Serial.printf("IMU %s: %u readings interval %u - %uus read %uus\n", imuMode == IMU_FUSION ? "fusion" : "DMP", 
+      imuReadings, imuIntervalMin, imuIntervalMax, imuReadMicros / imuReadings);
+
+    imuReadings = 0;
+    imuIntervalMin = UINT32_MAX;
+    imuIntervalMax = 0;
+    imuReadMicros = 0;
+  }
+#endif
 }
@@ -0,0 +1,114 @@
+// config_store.h on the host: pio test -e native
+
+#include <stddef.h>
+#include <unity.h>
+#include "config_store.h"
+
+struct TestConfig
+{
+  uint8_t a;
+  uint16_t b;
+  uint8_t added; // as if it were put on the end by a later version
+};
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_crc_is_zlib_crc32()
+{
+  const char *check = "123456789";
+
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, configCrc((const uint8_t *)check, 9));
+  TEST_ASSERT_EQUAL_HEX32(0, configCrc((const uint8_t *)check, 0));
+}
+
+void test_pack_then_unpack()
+{
+  TestConfig saved = {1, 1000, 7};
+  TestConfig read = {0, 0, 0};
+  uint8_t record[sizeof(ConfigHeader) + sizeof(TestConfig)];
+  uint16_t version = 0;
+  uint32_t sequence = 0;
+
+  size_t length = configPack(record, &saved, sizeof(saved), 3, 41);
+
+  TEST_ASSERT_EQUAL(sizeof(record), length);
+  TEST_ASSERT_TRUE(configUnpack(record, length, &read, sizeof(read), version, sequence));
+  TEST_ASSERT_EQUAL_MEMORY(&saved, &read, sizeof(saved));
+  TEST_ASSERT_EQUAL_UINT16(3, version);
+  TEST_ASSERT_EQUAL_UINT32(41, sequence);
+}
+
+void test_any_changed_byte_is_caught()
+{
+  TestConfig saved = {1, 1000, 7};
+  uint8_t record[sizeof(ConfigHeader) + sizeof(TestConfig)];
+  size_t length = configPack(record, &saved, sizeof(saved), 1, 1);
+  ConfigHeader header;
+
+  for(size_t i = 0; i < length; i++)
+  {
+    record[i] ^= 0x10;
+    TEST_ASSERT_FALSE(configCheck(record, length, header));
+    record[i] ^= 0x10;
+  }
+
+  TEST_ASSERT_TRUE(configCheck(record, length, header));
+}
+
+void test_short_record_is_rejected()
+{
+  TestConfig saved = {1, 1000, 7};
+  TestConfig read = {9, 9, 9};
+  uint8_t record[sizeof(ConfigHeader) + sizeof(TestConfig)];
+  uint16_t version = 0;
+  uint32_t sequence = 0;
+
+  size_t length = configPack(record, &saved, sizeof(saved), 1, 1);
+
+  TEST_ASSERT_FALSE(configUnpack(record, length - 1, &read, sizeof(read), version, sequence));
+  TEST_ASSERT_FALSE(configUnpack(record, 3, &read, sizeof(read), version, sequence));
+  TEST_ASSERT_EQUAL_UINT8(9, read.a); // left alone
+}
+
+void test_older_record_keeps_the_defaults_for_new_fields()
+{
+  TestConfig saved = {1, 1000, 7};
+  TestConfig read = {0, 0, 55};
+  uint8_t record[sizeof(ConfigHeader) + sizeof(TestConfig)];
+  uint16_t version = 0;
+  uint32_t sequence = 0;
+
+  size_t length = configPack(record, &saved, offsetof(TestConfig, added), 1, 1);
+
+  TEST_ASSERT_TRUE(configUnpack(record, length, &read, sizeof(read), version, sequence));
+  TEST_ASSERT_EQUAL_UINT8(1, read.a);
+  TEST_ASSERT_EQUAL_UINT16(1000, read.b);
+  TEST_ASSERT_EQUAL_UINT8(55, read.added);
+}
+
+void test_sequence_numbers_wrap()
+{
+  TEST_ASSERT_TRUE(configNewer(2, 1));
+  TEST_ASSERT_FALSE(configNewer(1, 2));
+  TEST_ASSERT_FALSE(configNewer(5, 5));
+  TEST_ASSERT_TRUE(configNewer(0, 0xFFFFFFFF));
+  TEST_ASSERT_TRUE(configSlot(7) != configSlot(8));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_crc_is_zlib_crc32);
+  RUN_TEST(test_pack_then_unpack);
+  RUN_TEST(test_any_changed_byte_is_caught);
+  RUN_TEST(test_short_record_is_rejected);
+  RUN_TEST(test_older_record_keeps_the_defaults_for_new_fields);
+  RUN_TEST(test_sequence_numbers_wrap);
+  return UNITY_END();
+}
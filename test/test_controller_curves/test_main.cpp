@@ -0,0 +1,205 @@
+// controller_curves.h and controller_routes.h on the host: pio test -e native
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unity.h>
+#include "controller_routes.h"
+
+ControllerCurve curve;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int32_t degrees(double d)
+{
+  return degreesToBinaryAngle(d);
+}
+
+void test_linear()
+{
+  AxisSettings settings = {CURVE_LINEAR, 0, 30, 0, false};
+
+  curveBuild(curve, settings);
+
+  TEST_ASSERT_EQUAL_INT16(0, curveApply(curve, 0));
+  TEST_ASSERT_INT_WITHIN(64, 16384, curveApply(curve, degrees(15)));
+  TEST_ASSERT_INT_WITHIN(64, -16384, curveApply(curve, degrees(-15)));
+  TEST_ASSERT_INT_WITHIN(8, 32767, curveApply(curve, degrees(30)));
+  TEST_ASSERT_INT_WITHIN(2, 32767, curveApply(curve, degrees(80))); // past the range
+  TEST_ASSERT_INT_WITHIN(2, -32767, curveApply(curve, degrees(-80)));
+}
+
+void test_dead_zone_and_invert()
+{
+  AxisSettings settings = {CURVE_LINEAR, 0, 30, 10, true};
+
+  curveBuild(curve, settings);
+
+  TEST_ASSERT_EQUAL_INT16(0, curveApply(curve, degrees(9.9)));
+  TEST_ASSERT_EQUAL_INT16(0, curveApply(curve, degrees(-9.9)));
+  TEST_ASSERT_INT_WITHIN(64, -16384, curveApply(curve, degrees(20)));
+  TEST_ASSERT_INT_WITHIN(64, 16384, curveApply(curve, degrees(-20)));
+}
+
+void test_curves_are_monotonic_and_end_at_full_scale()
+{
+  for(int type = 0; type < CURVE_TYPES; type++)
+  {
+    AxisSettings settings = {(uint8_t)type, 60, 45, 0, false};
+    int16_t last = 0;
+
+    curveBuild(curve, settings);
+
+    for(double d = 0.0; d <= 45.0; d += 0.25)
+    {
+      int16_t y = curveApply(curve, degrees(d));
+
+      TEST_ASSERT_GREATER_OR_EQUAL(last, y);
+      last = y;
+    }
+
+    TEST_ASSERT_INT_WITHIN(8, 32767, last);
+  }
+}
+
+void test_expo_is_gentler_in_the_middle()
+{
+  AxisSettings settings = {CURVE_EXPO, 50, 30, 0, false};
+
+  curveBuild(curve, settings);
+
+  TEST_ASSERT_LESS_THAN(16384 / 2, curveApply(curve, degrees(15)));
+}
+
+// The pitch bend as processPitchBend() worked it out before the curve tables: 30% expo over 30 degrees
+double oldPitchBend(double pitch)
+{
+  double bendX = pitch / 30.0;
+
+  if(bendX > 1.0)
+    bendX = 1.0;
+  else if(bendX < -1.0)
+    bendX = -1.0;
+
+  const double MaxExpo = 5.0;
+  const double a1 = 30.0;
+  double a2 = a1/100.0 * MaxExpo;
+  double a3 = 1.0 / exp(a2);
+
+  return bendX * exp(fabs(a2 * bendX)) * a3;
+}
+
+void test_expo_table_matches_the_old_exp_path()
+{
+  AxisSettings settings = {CURVE_EXPO, 30, 30, 0, false};
+  double worst = 0.0;
+
+  curveBuild(curve, settings);
+
+  for(double d = -40.0; d <= 40.0; d += 0.01)
+  {
+    double error = fabs(curveApply(curve, degrees(d)) / 32767.0 - oldPitchBend(d));
+
+    if(error > worst)
+      worst = error;
+  }
+
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, 0.0, worst); // the binary angle itself is only 0.0055 degrees
+}
+
+// Not a pass or fail, the time each takes on this machine
+void test_cost_against_the_exp_path()
+{
+  const int updates = 1000000;
+  AxisSettings settings = {CURVE_EXPO, 30, 30, 0, false};
+  volatile double oldSum = 0.0;
+  volatile int32_t newSum = 0;
+  char message[80];
+
+  curveBuild(curve, settings);
+
+  clock_t start = clock();
+
+  for(int i = 0; i < updates; i++)
+    oldSum = oldSum + oldPitchBend((i % 8000) / 100.0 - 40.0);
+
+  clock_t middle = clock();
+
+  for(int i = 0; i < updates; i++)
+    newSum = newSum + curveApply(curve, degrees((i % 8000) / 100.0 - 40.0));
+
+  clock_t end = clock();
+
+  snprintf(message, sizeof(message), "exp() %.0fns, table %.0fns per update (both with the angle conversion)",
+    (double)(middle - start) / CLOCKS_PER_SEC * 1e9 / updates, (double)(end - middle) / CLOCKS_PER_SEC * 1e9 / updates);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(oldSum != 0.0 || newSum != 0);
+}
+
+void test_high_res_routes_and_duplicates()
+{
+  Route routes[] = {
+    {SOURCE_PITCH, DEST_PITCH_BEND, 0, ROUTE_GATED, {CURVE_LINEAR, 0, 30, 0, false}},
+    {SOURCE_ROLL, DEST_CC, 1, ROUTE_ABSOLUTE, {CURVE_LINEAR, 0, 25, 0, false}},
+    {SOURCE_YAW, DEST_NONE, 0, 0, {CURVE_LINEAR, 0, 45, 0, false}},
+    {SOURCE_PRESSURE, DEST_CC, 74, 0, {CURVE_LINEAR, 0, 90, 0, false}},
+    {SOURCE_OPTION2, DEST_CC, 1, 0, {CURVE_LINEAR, 0, 90, 0, false}}, // takes CC 1 from roll
+    {SOURCE_OPTION3, DEST_CC, 200, 0, {CURVE_LINEAR, 0, 90, 0, false}} // not valid
+  };
+  CompiledRoute compiled[MAX_ROUTES];
+
+  int n = routesCompile(routes, 6, compiled, true);
+
+  TEST_ASSERT_EQUAL_INT(3, n);
+  TEST_ASSERT_EQUAL_UINT8(DEST_PITCH_BEND, compiled[0].destination);
+  TEST_ASSERT_EQUAL_UINT8(DEST_CC, compiled[1].destination); // 74 can't be 14 bit
+  TEST_ASSERT_EQUAL_UINT8(SOURCE_OPTION2, compiled[2].source);
+  TEST_ASSERT_EQUAL_UINT8(DEST_CC14, compiled[2].destination);
+  TEST_ASSERT_FALSE(routesUse(compiled, n, SOURCE_ROLL));
+  TEST_ASSERT_FALSE(routesUse(compiled, n, SOURCE_YAW));
+  TEST_ASSERT_TRUE(routesUse(compiled, n, SOURCE_PRESSURE));
+
+  n = routesCompile(routes, 2, compiled, false);
+
+  TEST_ASSERT_EQUAL_UINT8(DEST_CC, compiled[1].destination);
+}
+
+void test_route_values()
+{
+  Route routes[] = {
+    {SOURCE_PITCH, DEST_PITCH_BEND, 0, 0, {CURVE_LINEAR, 0, 30, 0, false}},
+    {SOURCE_ROLL, DEST_CC, 1, ROUTE_ABSOLUTE, {CURVE_LINEAR, 0, 30, 0, false}}
+  };
+  CompiledRoute compiled[MAX_ROUTES];
+
+  routesCompile(routes, 2, compiled, false);
+
+  TEST_ASSERT_EQUAL_INT(8192, routeRest(compiled[0]));
+  TEST_ASSERT_EQUAL_INT(8192, routeValue(compiled[0], 0));
+  TEST_ASSERT_EQUAL_INT(16383, routeValue(compiled[0], degrees(30)));
+  TEST_ASSERT_INT_WITHIN(1, 0, routeValue(compiled[0], degrees(-30)));
+
+  TEST_ASSERT_EQUAL_INT(0, routeRest(compiled[1]));
+  TEST_ASSERT_INT_WITHIN(16, 8192, routeValue(compiled[1], degrees(15)));
+  TEST_ASSERT_INT_WITHIN(16, 8192, routeValue(compiled[1], degrees(-15)));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_linear);
+  RUN_TEST(test_dead_zone_and_invert);
+  RUN_TEST(test_curves_are_monotonic_and_end_at_full_scale);
+  RUN_TEST(test_expo_is_gentler_in_the_middle);
+  RUN_TEST(test_expo_table_matches_the_old_exp_path);
+  RUN_TEST(test_cost_against_the_exp_path);
+  RUN_TEST(test_high_res_routes_and_duplicates);
+  RUN_TEST(test_route_values);
+  return UNITY_END();
+}
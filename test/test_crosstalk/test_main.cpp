@@ -0,0 +1,191 @@
+// crosstalk.h on the host: pio test -e native
+
+#include <stdio.h>
+#include <time.h>
+#include <unity.h>
+#include "crosstalk.h"
+
+#define PADS 9
+
+CrosstalkMatrix matrix;
+int16_t delta[CROSSTALK_LANES + 2];
+int16_t compensated[CROSSTALK_LANES];
+
+void setUp()
+{
+  matrix = CrosstalkMatrix();
+
+  for(int i = 0; i < CROSSTALK_LANES + 2; i++)
+    delta[i] = 0;
+}
+
+void tearDown()
+{
+}
+
+// What the pads read when only pad touched has touchDelta, the neighbours get their share
+void leak(int touched, int16_t touchDelta, const CrosstalkMatrix &coupling)
+{
+  for(int i = 0; i < CROSSTALK_LANES + 2; i++)
+    delta[i] = 0;
+
+  delta[touched + 1] = touchDelta;
+
+  if(touched > 0)
+    delta[touched] = (int32_t)coupling.right[touched - 1] * touchDelta >> 15;
+
+  if(touched < PADS - 1)
+    delta[touched + 2] = (int32_t)coupling.left[touched + 1] * touchDelta >> 15;
+}
+
+void test_no_coupling_changes_nothing()
+{
+  for(int i = 0; i < PADS; i++)
+    delta[i + 1] = i * 100 - 300;
+
+  TEST_ASSERT_FALSE(crosstalkActive(matrix));
+
+  crosstalkCompensate(matrix, delta, compensated);
+
+  for(int i = 0; i < PADS; i++)
+    TEST_ASSERT_EQUAL_INT16(delta[i + 1], compensated[i]);
+}
+
+void test_leak_is_taken_out()
+{
+  matrix.right[3] = 16384; // pad 3 sees half of pad 4
+  matrix.left[5] = 8192;   // pad 5 sees a quarter of it
+
+  TEST_ASSERT_TRUE(crosstalkActive(matrix));
+
+  leak(4, 2000, matrix);
+  crosstalkCompensate(matrix, delta, compensated);
+
+  TEST_ASSERT_INT_WITHIN(1, 0, compensated[3]);
+  TEST_ASSERT_EQUAL_INT16(2000, compensated[4]);
+  TEST_ASSERT_INT_WITHIN(1, 0, compensated[5]);
+}
+
+void test_output_is_clamped()
+{
+  matrix.left[1] = -29491;
+  delta[1] = 32767;
+  delta[2] = 32767;
+
+  crosstalkCompensate(matrix, delta, compensated);
+
+  TEST_ASSERT_EQUAL_INT16(32767, compensated[1]);
+}
+
+void test_the_largest_delta_is_the_touched_pad()
+{
+  bool on[PADS] = {false};
+
+  TEST_ASSERT_EQUAL_INT(-1, crosstalkCalibrationPad(delta, on, PADS));
+
+  delta[5] = 900;  // pad 4
+  delta[6] = 3000; // pad 5
+  on[4] = true;
+  on[5] = true;
+
+  TEST_ASSERT_EQUAL_INT(5, crosstalkCalibrationPad(delta, on, PADS)); // a neighbour over its level is kept
+
+  delta[2] = 2000; // pad 1, a second finger
+  on[1] = true;
+
+  TEST_ASSERT_EQUAL_INT(-1, crosstalkCalibrationPad(delta, on, PADS));
+}
+
+void test_calibration_finds_the_coupling()
+{
+  CrosstalkMatrix coupling = CrosstalkMatrix();
+  CrosstalkCalibration cal;
+  CrosstalkMatrix found;
+
+  coupling.right[2] = 9830; // 0.3
+  coupling.left[4] = 3277;  // 0.1
+  coupling.left[1] = 26214; // 0.8, strong enough to put pad 1 over its on level
+
+  crosstalkCalibrationReset(cal);
+
+  for(int touched = 0; touched < PADS; touched++)
+  {
+    for(int16_t d = 500; d <= 4000; d += 50)
+    {
+      bool on[PADS];
+
+      leak(touched, d, coupling);
+
+      for(int i = 0; i < PADS; i++)
+        on[i] = delta[i + 1] > 300;
+
+      int pad = crosstalkCalibrationPad(delta, on, PADS);
+
+      TEST_ASSERT_EQUAL_INT(touched, pad);
+      crosstalkCalibrationSample(cal, delta, pad, PADS);
+    }
+  }
+
+  int count = crosstalkCalibrationSolve(cal, found, 10);
+
+  TEST_ASSERT_EQUAL_INT(3, count);
+  TEST_ASSERT_INT_WITHIN(100, 9830, found.right[2]);
+  TEST_ASSERT_INT_WITHIN(100, 3277, found.left[4]);
+  TEST_ASSERT_INT_WITHIN(100, 26214, found.left[1]);
+  TEST_ASSERT_EQUAL_INT16(0, found.left[2]);
+}
+
+void test_too_few_samples_leave_it_uncoupled()
+{
+  CrosstalkCalibration cal;
+  CrosstalkMatrix coupling = CrosstalkMatrix();
+  CrosstalkMatrix found;
+
+  coupling.right[2] = 9830;
+  crosstalkCalibrationReset(cal);
+  leak(3, 2000, coupling);
+  crosstalkCalibrationSample(cal, delta, 3, PADS);
+
+  TEST_ASSERT_EQUAL_INT(0, crosstalkCalibrationSolve(cal, found, 10));
+  TEST_ASSERT_FALSE(crosstalkActive(found));
+}
+
+// Not a pass or fail, the time one scan's compensation takes on this machine
+void test_cost_per_scan()
+{
+  const int scans = 1000000;
+  volatile int32_t sum = 0;
+  char message[64];
+
+  for(int i = 0; i < PADS; i++)
+  {
+    matrix.left[i] = 2000 + i * 100;
+    matrix.right[i] = 1500 + i * 100;
+  }
+
+  clock_t start = clock();
+
+  for(int n = 0; n < scans; n++)
+  {
+    delta[1 + n % PADS] = n & 0x3FFF;
+    crosstalkCompensate(matrix, delta, compensated);
+    sum = sum + compensated[n % PADS];
+  }
+
+  snprintf(message, sizeof(message), "%.1fns per scan", (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / scans);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(sum != 0);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_no_coupling_changes_nothing);
+  RUN_TEST(test_leak_is_taken_out);
+  RUN_TEST(test_output_is_clamped);
+  RUN_TEST(test_the_largest_delta_is_the_touched_pad);
+  RUN_TEST(test_calibration_finds_the_coupling);
+  RUN_TEST(test_too_few_samples_leave_it_uncoupled);
+  RUN_TEST(test_cost_per_scan);
+  return UNITY_END();
+}
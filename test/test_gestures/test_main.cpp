@@ -0,0 +1,196 @@
+// gestures.h on the host: pio test -e native
+// The streams are 1kHz readings made the way the IMU task makes them in fusion mode: raw accelerometer
+// and gyro values (clipped to 16 bits as the MPU6050 does) turned into mg with gravity taken out and
+// deg/s, as in detectGestures().
+
+#include <math.h>
+#include <unity.h>
+#include "tilt.h"
+#include "gestures.h"
+
+// the same as gestureSettings in main.cpp
+const GestureSettings settings = {
+  2000, 40,
+  800, 4, 800,
+  300, 250, 0,
+  400
+};
+
+struct Motion
+{
+  double accel[3]; // g, not counting gravity
+  double gyro[3];  // deg/s
+};
+
+typedef Motion (*Stream)(uint32_t ms);
+
+GestureDetector detector;
+uint8_t events[16];
+int eventCount;
+
+void setUp()
+{
+  gestureReset(detector, settings);
+  eventCount = 0;
+}
+
+void tearDown()
+{
+}
+
+int16_t clip(double value)
+{
+  return (int16_t)(value > 32767 ? 32767 : (value < -32768 ? -32768 : lround(value)));
+}
+
+// Flat and still apart from the stream, accelPerG is the range the accelerometer is read at
+void play(Stream stream, uint32_t length, int32_t accelPerG)
+{
+  const int16_t flat[4] = {16384, 0, 0, 0};
+  int16_t gravity[3];
+
+  tiltGravity(flat, gravity);
+
+  for(uint32_t ms = 0; ms < length; ms++)
+  {
+    Motion m = stream(ms);
+    int16_t linear[3];
+    int16_t rate[3];
+
+    for(int i = 0; i < 3; i++)
+    {
+      int16_t accel = clip((m.accel[i] + (i == 2 ? 1.0 : 0.0)) * accelPerG);
+      int16_t gyro = clip(m.gyro[i] * 16.4);
+
+      linear[i] = (int32_t)accel * 1000 / accelPerG - gravity[i];
+      rate[i] = (int32_t)gyro * 10 / 164;
+    }
+
+    uint8_t event = gestureUpdate(detector, linear, rate, 1000 + ms);
+
+    if(event != GESTURE_NONE && eventCount < (int)sizeof(events))
+      events[eventCount++] = event;
+  }
+}
+
+double pulse(uint32_t ms, uint32_t start, uint32_t width, double peak)
+{
+  if(ms < start || ms >= start + width)
+    return 0.0;
+
+  return peak * sin(M_PI * (ms - start) / width);
+}
+
+// a knock on the side of the case: 3g for 6ms along x with a smaller bounce back
+Motion tap(uint32_t ms)
+{
+  Motion m = {{pulse(ms, 100, 6, 3.0) - pulse(ms, 106, 10, 0.6), 0, 0}, {0, 0, 0}};
+
+  return m;
+}
+
+// along y at 5Hz, 1.5g either way
+Motion shake(uint32_t ms)
+{
+  Motion m = {{0, ms >= 100 && ms < 1100 ? 1.5 * sin(2 * M_PI * 5 * (ms - 100) / 1000.0) : 0.0, 0}, {0, 0, 0}};
+
+  return m;
+}
+
+// pitched up quickly and stopped, 500 deg/s at the fastest
+Motion flickUp(uint32_t ms)
+{
+  Motion m = {{0, 0, 0}, {pulse(ms, 100, 120, 500.0), 0, 0}};
+
+  return m;
+}
+
+Motion flickDown(uint32_t ms)
+{
+  Motion m = {{0, 0, 0}, {-pulse(ms, 100, 120, 500.0), 0, 0}};
+
+  return m;
+}
+
+// turned over at 400 deg/s for half a second, too long for a flick
+Motion turn(uint32_t ms)
+{
+  Motion m = {{0, 0, 0}, {pulse(ms, 100, 600, 400.0), 0, 0}};
+
+  return m;
+}
+
+// tilting about for pitch bend and modwheel while playing
+Motion playing(uint32_t ms)
+{
+  double t = ms / 1000.0;
+  Motion m = {
+    {0.3 * sin(2 * M_PI * 1.3 * t), 0.25 * sin(2 * M_PI * 0.7 * t + 1), 0.2 * sin(2 * M_PI * 2.1 * t)},
+    {120 * sin(2 * M_PI * 0.9 * t), 80 * sin(2 * M_PI * 1.7 * t), 60 * sin(2 * M_PI * 0.4 * t)}
+  };
+
+  return m;
+}
+
+void test_tap()
+{
+  play(tap, 600, 4096);
+
+  TEST_ASSERT_EQUAL_INT(1, eventCount);
+  TEST_ASSERT_EQUAL_UINT8(GESTURE_TAP, events[0]);
+}
+
+void test_tap_is_missed_when_clipped_at_2g()
+{
+  play(tap, 600, 16384);
+
+  TEST_ASSERT_EQUAL_INT(0, eventCount);
+}
+
+void test_shake()
+{
+  play(shake, 1500, 4096);
+
+  TEST_ASSERT_EQUAL_INT(1, eventCount); // the rest of it is in the refractory time or too few reversals
+  TEST_ASSERT_EQUAL_UINT8(GESTURE_SHAKE, events[0]);
+}
+
+void test_flicks()
+{
+  play(flickUp, 600, 4096);
+
+  TEST_ASSERT_EQUAL_INT(1, eventCount);
+  TEST_ASSERT_EQUAL_UINT8(GESTURE_FLICK_UP, events[0]);
+
+  setUp();
+  play(flickDown, 600, 4096);
+
+  TEST_ASSERT_EQUAL_INT(1, eventCount);
+  TEST_ASSERT_EQUAL_UINT8(GESTURE_FLICK_DOWN, events[0]);
+}
+
+void test_slow_turn_is_not_a_flick()
+{
+  play(turn, 1000, 4096);
+
+  TEST_ASSERT_EQUAL_INT(0, eventCount);
+}
+
+void test_playing_gives_nothing()
+{
+  play(playing, 20000, 4096);
+
+  TEST_ASSERT_EQUAL_INT(0, eventCount);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_tap);
+  RUN_TEST(test_tap_is_missed_when_clipped_at_2g);
+  RUN_TEST(test_shake);
+  RUN_TEST(test_flicks);
+  RUN_TEST(test_slow_turn_is_not_a_flick);
+  RUN_TEST(test_playing_gives_nothing);
+  return UNITY_END();
+}
@@ -0,0 +1,183 @@
+// Counts the heap allocations made by everything a note event goes through that can be built on the
+// host (pio test -e native): the crosstalk compensation, the latency histogram, the notes display text,
+// the controller routes, the tilt and gesture updates and the SysEx parser. There should be none.
+//
+// operator new is counted everywhere. malloc() is counted too where the C library is glibc, through its
+// __libc_ entry points.
+
+#include <stdlib.h>
+#include <new>
+#include <unity.h>
+#include "crosstalk.h"
+#include "latency_histogram.h"
+#include "note_names.h"
+#include "controller_routes.h"
+#include "tilt.h"
+#include "gestures.h"
+#include "sysex_protocol.h"
+
+volatile uint32_t allocations = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+
+  void *p = malloc(size ? size : 1);
+
+  if(!p)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+#if defined(__GLIBC__)
+extern "C"
+{
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *p, size_t size);
+
+  void *malloc(size_t size)
+  {
+    allocations++;
+
+    return __libc_malloc(size);
+  }
+
+  void *calloc(size_t count, size_t size)
+  {
+    allocations++;
+
+    return __libc_calloc(count, size);
+  }
+
+  void *realloc(void *p, size_t size)
+  {
+    allocations++;
+
+    return __libc_realloc(p, size);
+  }
+}
+#endif
+
+#define NOTE_PINS 9
+#define TOTAL_NOTE_PINS 17
+
+CrosstalkMatrix crosstalk;
+LatencyHistogram sendLatency;
+char noteNames[128][NOTE_NAME_SIZE];
+bool notePinsOn[TOTAL_NOTE_PINS];
+uint8_t midiValues[TOTAL_NOTE_PINS];
+CompiledRoute compiledRoutes[MAX_ROUTES];
+int compiledRouteCount;
+GestureDetector gestures;
+uint8_t sysexBuffer[64];
+SysexParser sysexParser;
+
+void setUp()
+{
+  const Route routes[] = {
+    {SOURCE_PITCH, DEST_PITCH_BEND, 0, ROUTE_GATED, {CURVE_EXPO, 30, 30, 0, false}},
+    {SOURCE_ROLL, DEST_CC, 1, ROUTE_GATED | ROUTE_ABSOLUTE, {CURVE_LINEAR, 0, 25, 0, false}},
+    {SOURCE_PRESSURE, DEST_CHANNEL_PRESSURE, 0, 0, {CURVE_LINEAR, 0, 90, 0, false}}
+  };
+  const GestureSettings settings = {2000, 40, 800, 4, 800, 300, 250, 0, 400};
+
+  crosstalk.left[2] = 3000;
+  crosstalk.right[1] = 3000;
+  histogramReset(sendLatency);
+  noteNamesBuild(noteNames);
+
+  for(int i = 0; i < TOTAL_NOTE_PINS; i++)
+  {
+    notePinsOn[i] = false;
+    midiValues[i] = 48 + i * 2;
+  }
+
+  compiledRouteCount = routesCompile(routes, 3, compiledRoutes, true);
+  gestureReset(gestures, settings);
+  sysexInit(sysexParser, sysexBuffer, sizeof(sysexBuffer));
+}
+
+void tearDown()
+{
+}
+
+// One pass of the touch scan with pin touched going on, as loop() does it
+void noteEvent(int touched, uint32_t now)
+{
+  int16_t delta[CROSSTALK_LANES + 2] = {0};
+  int16_t compensated[CROSSTALK_LANES];
+  char text[TOTAL_NOTE_PINS * NOTE_NAME_SIZE + 1];
+
+  delta[touched + 1] = 4000;
+  crosstalkCompensate(crosstalk, delta, compensated);
+
+  notePinsOn[touched * 2] = compensated[touched] > 1000;
+  histogramAdd(sendLatency, 150 + touched);
+  notesOnText(text, sizeof(text), noteNames, notePinsOn, midiValues, TOTAL_NOTE_PINS, 12 + 3);
+
+  int16_t q[4] = {16000, 1200, -800, 300};
+  int16_t accel[3] = {(int16_t)(touched * 10), 20, -30};
+  int16_t gyro[3] = {5, -5, 2};
+  TiltAngles tilt;
+
+  tiltFromQuaternion(q, tilt, true);
+  gestureUpdate(gestures, accel, gyro, now);
+
+  for(int i = 0; i < compiledRouteCount; i++)
+    routeValue(compiledRoutes[i], compiledRoutes[i].source == SOURCE_PITCH ? tilt.pitch : tilt.roll);
+
+  const uint8_t incoming[] = {0xF0, SYSEX_MANUFACTURER, SYSEX_DEVICE, SYSEX_STATS_REQUEST, 0xF7};
+
+  for(unsigned i = 0; i < sizeof(incoming); i++)
+    sysexParse(sysexParser, incoming[i]);
+}
+
+void test_the_counter_counts()
+{
+  uint32_t before = allocations;
+  int *p = new int[4];
+
+  delete[] p;
+
+  TEST_ASSERT_GREATER_THAN(before, allocations);
+}
+
+void test_note_events_do_not_allocate()
+{
+  uint32_t before = allocations;
+
+  for(uint32_t n = 0; n < 1000; n++)
+  {
+    noteEvent(n % NOTE_PINS, n);
+
+    if(n % 7 == 0)
+      notePinsOn[(n % NOTE_PINS) * 2] = false;
+  }
+
+  TEST_ASSERT_EQUAL_UINT32(before, allocations);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_the_counter_counts);
+  RUN_TEST(test_note_events_do_not_allocate);
+  return UNITY_END();
+}
@@ -0,0 +1,156 @@
+// imu_fusion.h on the host: pio test -e native
+// The filter is run over IMU readings made from a known motion and its tilt is compared with the
+// truth through tiltFromQuaternion(), as the IMU task uses it. kp and ki are the ones in main.cpp.
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unity.h>
+#include "tilt.h"
+#include "imu_fusion.h"
+
+const float fusionKp = 1.0;
+const float fusionKi = 0.02;
+
+const double degreesPerBinary = 360.0 / 65536.0;
+
+MahonyFilter fusion;
+
+void setUp()
+{
+  fusionReset(fusion, fusionKp, fusionKi);
+}
+
+void tearDown()
+{
+}
+
+// Rolled by roll radians about x, gravity as the accelerometer sees it
+void rolled(double roll, float *accel)
+{
+  accel[0] = 0.0f;
+  accel[1] = (float)sin(roll);
+  accel[2] = (float)cos(roll);
+}
+
+// the filter's roll less the truth in degrees
+double rollError(double roll)
+{
+  int16_t q[4];
+  TiltAngles angles;
+
+  fusionQuaternionQ14(fusion, q);
+  tiltFromQuaternion(q, angles, false);
+
+  return (int16_t)(angles.roll - (int16_t)lround(roll * 32768.0 / M_PI)) * degreesPerBinary;
+}
+
+void test_starts_at_the_accelerometer_tilt()
+{
+  int16_t q[4];
+  TiltAngles angles;
+
+  // gravity 10 degrees towards -x and rolled 20 degrees, tiltFromQuaternion() gives that pitch as -10
+  double pitch = 10 * M_PI / 180, roll = 20 * M_PI / 180;
+
+  fusionStartFromAccel(fusion, -sin(pitch), cos(pitch) * sin(roll), cos(pitch) * cos(roll));
+  fusionQuaternionQ14(fusion, q);
+  tiltFromQuaternion(q, angles, false);
+
+  TEST_ASSERT_FLOAT_WITHIN(0.1, 20.0, angles.roll * degreesPerBinary);
+  TEST_ASSERT_FLOAT_WITHIN(0.1, -10.0, angles.pitch * degreesPerBinary);
+}
+
+// Rolling back and forth 20 degrees at 2Hz, faster than anyone tilts it to bend, read at about 1kHz
+// with the interval wandering by 20% as it does on the IMU task
+void test_follows_a_fast_roll()
+{
+  const double amplitude = 20 * M_PI / 180;
+  const double w = 2 * M_PI * 2.0;
+  double t = 0.0;
+  double worst = 0.0;
+  uint32_t seed = 1;
+  float accel[3];
+
+  rolled(0.0, accel);
+  fusionStartFromAccel(fusion, accel[0], accel[1], accel[2]);
+
+  while(t < 5.0)
+  {
+    seed = seed * 1103515245 + 12345;
+
+    float dt = 0.001f * (0.8f + 0.4f * ((seed >> 16) & 0xFF) / 255.0f);
+
+    t += dt;
+
+    double roll = amplitude * sin(w * t);
+    double rate = amplitude * w * cos(w * t);
+
+    rolled(roll, accel);
+    fusionUpdate(fusion, (float)rate, 0.0f, 0.0f, accel[0], accel[1], accel[2], dt);
+
+    double error = fabs(rollError(roll));
+
+    if(error > worst)
+      worst = error;
+  }
+
+  TEST_ASSERT_FLOAT_WITHIN(0.5, 0.0, worst);
+}
+
+// Still and level with 2 deg/s of gyro bias left after the offsets, the integral takes it out
+void test_gyro_bias_is_trimmed_out()
+{
+  const float bias = 2 * M_PI / 180;
+  float accel[3];
+
+  rolled(0.0, accel);
+  fusionStartFromAccel(fusion, accel[0], accel[1], accel[2]);
+
+  for(int i = 0; i < 5000; i++)
+    fusionUpdate(fusion, bias, 0.0f, 0.0f, accel[0], accel[1], accel[2], 0.001f);
+
+  TEST_ASSERT_TRUE(fabs(rollError(0.0)) > 0.5); // only held off by kp at first
+
+  for(int i = 0; i < 120000; i++)
+    fusionUpdate(fusion, bias, 0.0f, 0.0f, accel[0], accel[1], accel[2], 0.001f);
+
+  TEST_ASSERT_FLOAT_WITHIN(0.2, 0.0, rollError(0.0));
+}
+
+// Not a pass or fail, the time an update and the tilt take on this machine
+void test_cost_per_reading()
+{
+  const int readings = 1000000;
+  float accel[3];
+  int16_t q[4];
+  TiltAngles angles;
+  char message[64];
+
+  rolled(0.3, accel);
+
+  clock_t start = clock();
+
+  for(int i = 0; i < readings; i++)
+  {
+    fusionUpdate(fusion, 0.01f, 0.02f, -0.01f, accel[0], accel[1], accel[2], 0.001f);
+    fusionQuaternionQ14(fusion, q);
+    tiltFromQuaternion(q, angles, true);
+  }
+
+  double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / readings;
+
+  snprintf(message, sizeof(message), "fusion and tilt %.0fns per reading", ns);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(angles.roll != 0);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_starts_at_the_accelerometer_tilt);
+  RUN_TEST(test_follows_a_fast_roll);
+  RUN_TEST(test_gyro_bias_is_trimmed_out);
+  RUN_TEST(test_cost_per_reading);
+  return UNITY_END();
+}
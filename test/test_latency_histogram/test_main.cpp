@@ -0,0 +1,73 @@
+// latency_histogram.h on the host: pio test -e native
+
+#include <unity.h>
+#include "latency_histogram.h"
+
+LatencyHistogram histogram;
+
+void setUp()
+{
+  histogramReset(histogram);
+}
+
+void tearDown()
+{
+}
+
+void test_small_times_have_their_own_bucket()
+{
+  for(uint32_t t = 0; t < 16; t++)
+  {
+    TEST_ASSERT_EQUAL_INT(t, histogramBucket(t));
+    TEST_ASSERT_EQUAL_UINT32(t, histogramBucketMicros(t));
+  }
+}
+
+void test_buckets_are_in_order_and_within_an_eighth()
+{
+  int last = 0;
+
+  for(uint32_t t = 1; t < 16000000; t += t / 64 + 1)
+  {
+    int bucket = histogramBucket(t);
+    uint32_t bottom = histogramBucketMicros(bucket);
+
+    TEST_ASSERT_GREATER_OR_EQUAL(last, bucket);
+    TEST_ASSERT_LESS_THAN(HISTOGRAM_BUCKETS, bucket);
+    TEST_ASSERT_LESS_OR_EQUAL(t, bottom);
+    TEST_ASSERT_GREATER_OR_EQUAL(t - t / 8, bottom);
+
+    last = bucket;
+  }
+}
+
+void test_long_times_go_in_the_last_bucket()
+{
+  TEST_ASSERT_EQUAL_INT(HISTOGRAM_BUCKETS - 1, histogramBucket(0xFFFFFFFF));
+  TEST_ASSERT_EQUAL_INT(HISTOGRAM_BUCKETS - 1, histogramBucket(1 << 24));
+}
+
+void test_percentiles()
+{
+  TEST_ASSERT_EQUAL_UINT32(0, histogramPercentile(histogram, 50)); // nothing yet
+
+  for(int i = 0; i < 99; i++)
+    histogramAdd(histogram, 10);
+
+  histogramAdd(histogram, 5000);
+
+  TEST_ASSERT_EQUAL_UINT32(100, histogram.count);
+  TEST_ASSERT_EQUAL_UINT32(10, histogramPercentile(histogram, 50));
+  TEST_ASSERT_EQUAL_UINT32(10, histogramPercentile(histogram, 99));
+  TEST_ASSERT_UINT32_WITHIN(5000 / 8, 5000, histogramPercentile(histogram, 100));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_small_times_have_their_own_bucket);
+  RUN_TEST(test_buckets_are_in_order_and_within_an_eighth);
+  RUN_TEST(test_long_times_go_in_the_last_bucket);
+  RUN_TEST(test_percentiles);
+  return UNITY_END();
+}
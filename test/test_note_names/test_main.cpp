@@ -0,0 +1,67 @@
+// note_names.h on the host: pio test -e native
+
+#include <unity.h>
+#include "note_names.h"
+
+char names[128][NOTE_NAME_SIZE];
+
+void setUp()
+{
+  noteNamesBuild(names);
+}
+
+void tearDown()
+{
+}
+
+void test_names()
+{
+  TEST_ASSERT_EQUAL_STRING("C-2", names[0]);
+  TEST_ASSERT_EQUAL_STRING("C#-2", names[1]);
+  TEST_ASSERT_EQUAL_STRING("C3", names[60]);
+  TEST_ASSERT_EQUAL_STRING("A3", names[69]);
+  TEST_ASSERT_EQUAL_STRING("G8", names[127]);
+}
+
+void test_notes_on()
+{
+  bool on[5] = {false, true, false, true, false};
+  uint8_t notes[5] = {60, 62, 64, 65, 67};
+  char text[5 * NOTE_NAME_SIZE + 1];
+
+  notesOnText(text, sizeof(text), names, on, notes, 5, 0);
+  TEST_ASSERT_EQUAL_STRING("D3 F3 ", text);
+
+  notesOnText(text, sizeof(text), names, on, notes, 5, -12 + 2); // octave down, key of D
+  TEST_ASSERT_EQUAL_STRING("E2 G2 ", text);
+
+  on[4] = true;
+  notesOnText(text, sizeof(text), names, on, notes, 5, 0);
+  TEST_ASSERT_EQUAL_STRING("D3 F3 G3", text); // no space after the last pin
+
+  for(int i = 0; i < 5; i++)
+    on[i] = false;
+
+  notesOnText(text, sizeof(text), names, on, notes, 5, 0);
+  TEST_ASSERT_EQUAL_STRING("", text);
+}
+
+void test_what_does_not_fit_is_left_off()
+{
+  bool on[4] = {true, true, true, true};
+  uint8_t notes[4] = {61, 63, 66, 68};
+  char text[12];
+
+  notesOnText(text, sizeof(text), names, on, notes, 4, 0);
+
+  TEST_ASSERT_EQUAL_STRING("C#3 D#3 F#3", text);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_names);
+  RUN_TEST(test_notes_on);
+  RUN_TEST(test_what_does_not_fit_is_left_off);
+  return UNITY_END();
+}
@@ -0,0 +1,157 @@
+// sysex_protocol.h on the host: pio test -e native
+
+#include <unity.h>
+#include "sysex_protocol.h"
+
+uint8_t buffer[64];
+SysexParser parser;
+
+void setUp()
+{
+  sysexInit(parser, buffer, sizeof(buffer));
+}
+
+void tearDown()
+{
+}
+
+// F0 7D 4B command encoded-data F7 into message[], returns its length
+int makeMessage(uint8_t command, const uint8_t *data, int length, uint8_t *message)
+{
+  int n = 0;
+
+  message[n++] = 0xF0;
+  message[n++] = SYSEX_MANUFACTURER;
+  message[n++] = SYSEX_DEVICE;
+  message[n++] = command;
+  n += sysexEncode(data, length, message + n);
+  message[n++] = 0xF7;
+
+  return n;
+}
+
+uint8_t feed(const uint8_t *message, int length)
+{
+  uint8_t command = SYSEX_NONE;
+
+  for(int i = 0; i < length; i++)
+  {
+    uint8_t result = sysexParse(parser, message[i]);
+
+    if(result != SYSEX_NONE)
+      command = result;
+  }
+
+  return command;
+}
+
+void test_encoded_bytes_are_7_bit()
+{
+  uint8_t data[20];
+  uint8_t out[32];
+
+  for(int i = 0; i < 20; i++)
+    data[i] = 0x80 | (i * 13);
+
+  int n = sysexEncode(data, sizeof(data), out);
+
+  TEST_ASSERT_EQUAL_INT(sysexEncodedLength(sizeof(data)), n);
+
+  for(int i = 0; i < n; i++)
+    TEST_ASSERT_EQUAL_INT(0, out[i] & 0x80);
+}
+
+void test_every_length_round_trips()
+{
+  uint8_t data[40];
+  uint8_t message[80];
+
+  for(int i = 0; i < 40; i++)
+    data[i] = i * 37 + 5;
+
+  for(int length = 0; length <= 40; length++)
+  {
+    int n = makeMessage(SYSEX_CONFIG, data, length, message);
+
+    TEST_ASSERT_EQUAL_UINT8(SYSEX_CONFIG, feed(message, n));
+    TEST_ASSERT_EQUAL_INT(length, parser.length);
+    TEST_ASSERT_FALSE(parser.overflow);
+    TEST_ASSERT_EQUAL_MEMORY(data, buffer, length);
+  }
+}
+
+void test_real_time_in_the_middle_is_ignored()
+{
+  uint8_t data[] = {0x01, 0xFF, 0x80};
+  uint8_t message[16];
+  uint8_t withClock[17];
+
+  int n = makeMessage(SYSEX_CONFIG, data, sizeof(data), message);
+
+  memcpy(withClock, message, 5);
+  withClock[5] = 0xF8; // MIDI clock
+  memcpy(withClock + 6, message + 5, n - 5);
+
+  TEST_ASSERT_EQUAL_UINT8(SYSEX_CONFIG, feed(withClock, n + 1));
+  TEST_ASSERT_EQUAL_MEMORY(data, buffer, sizeof(data));
+}
+
+void test_other_manufacturers_and_devices_are_ignored()
+{
+  uint8_t other[] = {0xF0, 0x43, SYSEX_DEVICE, SYSEX_CONFIG_REQUEST, 0xF7};
+  uint8_t otherDevice[] = {0xF0, SYSEX_MANUFACTURER, 0x01, SYSEX_CONFIG_REQUEST, 0xF7};
+
+  TEST_ASSERT_EQUAL_UINT8(SYSEX_NONE, feed(other, sizeof(other)));
+  TEST_ASSERT_EQUAL_UINT8(SYSEX_NONE, feed(otherDevice, sizeof(otherDevice)));
+}
+
+void test_a_status_byte_ends_the_message()
+{
+  uint8_t message[] = {0xF0, SYSEX_MANUFACTURER, SYSEX_DEVICE, SYSEX_STATS_REQUEST, 0x90, 0xF7};
+
+  TEST_ASSERT_EQUAL_UINT8(SYSEX_NONE, feed(message, sizeof(message)));
+}
+
+void test_too_long_is_flagged()
+{
+  uint8_t data[70] = {0};
+  uint8_t message[100];
+
+  int n = makeMessage(SYSEX_CONFIG, data, sizeof(data), message);
+
+  TEST_ASSERT_EQUAL_UINT8(SYSEX_CONFIG, feed(message, n));
+  TEST_ASSERT_TRUE(parser.overflow);
+  TEST_ASSERT_EQUAL_INT(sizeof(buffer), parser.length);
+}
+
+void test_pieces_of_7_encode_the_same_as_the_whole()
+{
+  uint8_t data[30];
+  uint8_t whole[40];
+  uint8_t pieces[40];
+
+  for(int i = 0; i < 30; i++)
+    data[i] = 0xF0 ^ (i * 11);
+
+  int n = sysexEncode(data, sizeof(data), whole);
+  int m = sysexEncode(data, 14, pieces);
+
+  m += sysexEncode(data + 14, 7, pieces + m);
+  m += sysexEncode(data + 21, 9, pieces + m);
+
+  TEST_ASSERT_EQUAL_INT(n, m);
+  TEST_ASSERT_EQUAL_MEMORY(whole, pieces, n);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_encoded_bytes_are_7_bit);
+  RUN_TEST(test_every_length_round_trips);
+  RUN_TEST(test_real_time_in_the_middle_is_ignored);
+  RUN_TEST(test_other_manufacturers_and_devices_are_ignored);
+  RUN_TEST(test_a_status_byte_ends_the_message);
+  RUN_TEST(test_too_long_is_flagged);
+  RUN_TEST(test_pieces_of_7_encode_the_same_as_the_whole);
+  return UNITY_END();
+}
@@ -0,0 +1,126 @@
+// tilt.h on the host: pio test -e native
+// The angles are checked against the floating point maths of MPU6050::dmpGetYawPitchRoll().
+
+#include <math.h>
+#include <unity.h>
+#include "tilt.h"
+
+const double binaryPerRadian = 32768.0 / M_PI;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Q14 quaternion for yaw about z, then pitch about y, then roll about x
+void quaternion(double yaw, double pitch, double roll, int16_t *q)
+{
+  double cy = cos(yaw / 2), sy = sin(yaw / 2);
+  double cp = cos(pitch / 2), sp = sin(pitch / 2);
+  double cr = cos(roll / 2), sr = sin(roll / 2);
+
+  q[0] = (int16_t)lround((cr * cp * cy + sr * sp * sy) * 16384);
+  q[1] = (int16_t)lround((sr * cp * cy - cr * sp * sy) * 16384);
+  q[2] = (int16_t)lround((cr * sp * cy + sr * cp * sy) * 16384);
+  q[3] = (int16_t)lround((cr * cp * sy - sr * sp * cy) * 16384);
+}
+
+void reference(const int16_t *q, double *ypr)
+{
+  double w = q[0] / 16384.0, x = q[1] / 16384.0, y = q[2] / 16384.0, z = q[3] / 16384.0;
+  double gx = 2 * (x * z - w * y);
+  double gy = 2 * (w * x + y * z);
+  double gz = w * w - x * x - y * y + z * z;
+
+  ypr[0] = atan2(2 * x * y - 2 * w * z, 2 * w * w + 2 * x * x - 1);
+  ypr[1] = atan(gx / sqrt(gy * gy + gz * gz));
+  ypr[2] = atan2(gy, gz);
+
+  if(gz < 0)
+    ypr[1] = ypr[1] > 0 ? M_PI - ypr[1] : -M_PI - ypr[1];
+}
+
+int16_t binary(double radians)
+{
+  return (int16_t)(int32_t)lround(radians * binaryPerRadian);
+}
+
+void test_atan2_all_the_way_round()
+{
+  for(int degree = -179; degree <= 180; degree++)
+  {
+    double a = degree * M_PI / 180.0;
+    int32_t magnitude = 0;
+
+    int16_t angle = tiltAtan2((int32_t)(sin(a) * 1000000), (int32_t)(cos(a) * 1000000), &magnitude);
+
+    TEST_ASSERT_INT_WITHIN(4, 0, (int16_t)(angle - binary(a)));
+    TEST_ASSERT_INT_WITHIN(100, 1000000, magnitude);
+  }
+}
+
+void test_angles_match_the_library()
+{
+  for(int pitch = -80; pitch <= 80; pitch += 8)
+  {
+    for(int roll = -170; roll <= 170; roll += 17)
+    {
+      int16_t q[4];
+      double ypr[3];
+      TiltAngles angles;
+
+      quaternion(30 * M_PI / 180.0, pitch * M_PI / 180.0, roll * M_PI / 180.0, q);
+      reference(q, ypr);
+      tiltFromQuaternion(q, angles, true);
+
+      // 0.1 degree is 18
+      TEST_ASSERT_INT_WITHIN(18, 0, (int16_t)(angles.yaw - binary(ypr[0])));
+      TEST_ASSERT_INT_WITHIN(18, 0, (int16_t)(angles.pitch - binary(ypr[1])));
+      TEST_ASSERT_INT_WITHIN(18, 0, (int16_t)(angles.roll - binary(ypr[2])));
+    }
+  }
+}
+
+void test_yaw_is_left_alone_unless_asked_for()
+{
+  int16_t q[4];
+  TiltAngles angles = {1234, 0, 0};
+
+  quaternion(1.0, 0.2, 0.3, q);
+  tiltFromQuaternion(q, angles, false);
+
+  TEST_ASSERT_EQUAL_INT16(1234, angles.yaw);
+}
+
+void test_gravity_in_mg()
+{
+  int16_t q[4];
+  int16_t gravity[3];
+
+  quaternion(0, 0, 0, q);
+  tiltGravity(q, gravity);
+
+  TEST_ASSERT_INT_WITHIN(2, 0, gravity[0]);
+  TEST_ASSERT_INT_WITHIN(2, 0, gravity[1]);
+  TEST_ASSERT_INT_WITHIN(2, 1000, gravity[2]);
+
+  quaternion(0, 0, M_PI / 2, q); // rolled onto its side
+  tiltGravity(q, gravity);
+
+  TEST_ASSERT_INT_WITHIN(2, 0, gravity[0]);
+  TEST_ASSERT_INT_WITHIN(2, 1000, gravity[1]);
+  TEST_ASSERT_INT_WITHIN(2, 0, gravity[2]);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_atan2_all_the_way_round);
+  RUN_TEST(test_angles_match_the_library);
+  RUN_TEST(test_yaw_is_left_alone_unless_asked_for);
+  RUN_TEST(test_gravity_in_mg);
+  return UNITY_END();
+}
@@ -0,0 +1,96 @@
+// touch_autotune.h on the host: pio test -e native
+
+#include <unity.h>
+#include "touch_autotune.h"
+
+TouchPadStats stats;
+
+void setUp()
+{
+  autoTuneReset(stats);
+}
+
+void tearDown()
+{
+}
+
+// A pad at benchmark with noise of about +/- spread and touches that reach peak
+void record(uint32_t benchmark, uint32_t spread, uint32_t peak)
+{
+  uint32_t seed = 12345;
+
+  for(int i = 0; i < 2000; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    autoTuneIdleSample(stats, benchmark - spread + (seed >> 16) % (2 * spread + 1));
+  }
+
+  for(int i = 0; i < 50; i++)
+    autoTuneTouchSample(stats, benchmark + (peak - benchmark) * i / 49);
+}
+
+void test_sigmas_for_known_tails()
+{
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 0.0, autoTuneSigmas(0.5));
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 1.645, autoTuneSigmas(0.05));
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 3.0, autoTuneSigmas(0.00135));
+}
+
+void test_quiet_pad_gets_low_thresholds()
+{
+  uint16_t on = 0;
+  uint16_t off = 0;
+
+  record(20000, 100, 40000);
+
+  TEST_ASSERT_TRUE(autoTuneThresholds(stats, 20000, 1e-6, on, off));
+  TEST_ASSERT_LESS_THAN(300, on); // lower than the fixed 300
+  TEST_ASSERT_GREATER_OR_EQUAL(30, on); // never closer than 3%
+  TEST_ASSERT_LESS_THAN(on, off);
+  TEST_ASSERT_GREATER_OR_EQUAL(on / 2, off);
+}
+
+void test_noisy_pad_is_flagged()
+{
+  uint16_t on = 0;
+  uint16_t off = 0;
+
+  record(20000, 3000, 24000);
+
+  TEST_ASSERT_FALSE(autoTuneThresholds(stats, 20000, 1e-6, on, off));
+  TEST_ASSERT_LESS_THAN(on, off); // still usable
+  TEST_ASSERT_LESS_THAN(200, on); // half way up the 20% touch
+}
+
+void test_lower_false_trigger_rate_raises_note_on()
+{
+  uint16_t on1, off1, on2, off2;
+
+  record(20000, 400, 40000);
+
+  autoTuneThresholds(stats, 20000, 1e-3, on1, off1);
+  autoTuneThresholds(stats, 20000, 1e-9, on2, off2);
+
+  TEST_ASSERT_GREATER_THAN(on1, on2);
+}
+
+void test_nothing_recorded()
+{
+  uint16_t on = 300;
+  uint16_t off = 200;
+
+  TEST_ASSERT_FALSE(autoTuneThresholds(stats, 20000, 1e-6, on, off));
+  TEST_ASSERT_EQUAL_UINT16(300, on); // left alone
+  TEST_ASSERT_EQUAL_UINT16(200, off);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sigmas_for_known_tails);
+  RUN_TEST(test_quiet_pad_gets_low_thresholds);
+  RUN_TEST(test_noisy_pad_is_flagged);
+  RUN_TEST(test_lower_false_trigger_rate_raises_note_on);
+  RUN_TEST(test_nothing_recorded);
+  return UNITY_END();
+}